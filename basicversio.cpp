@@ -371,32 +371,9 @@ void processPullQuery(vector<string> command, unordered_map<int, StockOrder> &or
     }
 }
 
-vector<string> run(vector<string> const &input)
+//The function get summary of bests matches of stocks sorted by symbols and print the remaining stock. 
+void outPutPerSymbol(vector<string> &result, map<string, set<StockOrder, customComparator>> &symbolLookUp, set<string> &allSymbols)
 {
-    vector<string> result;
-    unordered_map<int, StockOrder> orderLookUp;
-    map<string, set<StockOrder, customComparator>> symbolLookUp;
-    set<string> allSymbols;
-    for (int i = 0; i < input.size(); i++)
-    {
-        vector<string> command = splitString(input[i]);
-        // Add the timestamp;
-        command.push_back(to_string(i));
-        if (command[0] == "INSERT")
-        {
-            processInsertQuery(command, result, orderLookUp, symbolLookUp, allSymbols);
-        }
-        else if (command[0] == "AMEND")
-        {
-            processAmendQuery(command, result, orderLookUp, symbolLookUp, allSymbols);
-        }
-        else if (command[0] == "PULL")
-        {
-            processPullQuery(command, orderLookUp, symbolLookUp, allSymbols);
-        }
-    }
-
-    //Print the best left match at the end sorted by symbol 
     for (const string &symbol : allSymbols)
     {
         string buyKey = symbol + "BUY";
@@ -443,9 +420,39 @@ vector<string> run(vector<string> const &input)
             }
         }
     }
+}
+
+vector<string> run(vector<string> const &input)
+{
+    vector<string> result;
+    unordered_map<int, StockOrder> orderLookUp;
+    map<string, set<StockOrder, customComparator>> symbolLookUp;
+    set<string> allSymbols;
+    for (int i = 0; i < input.size(); i++)
+    {
+        vector<string> command = splitString(input[i]);
+        // Add the timestamp;
+        command.push_back(to_string(i));
+        if (command[0] == "INSERT")
+        {
+            processInsertQuery(command, result, orderLookUp, symbolLookUp, allSymbols);
+        }
+        else if (command[0] == "AMEND")
+        {
+            processAmendQuery(command, result, orderLookUp, symbolLookUp, allSymbols);
+        }
+        else if (command[0] == "PULL")
+        {
+            processPullQuery(command, orderLookUp, symbolLookUp, allSymbols);
+        }
+    }
+
+    //Print the best left match at the end sorted by symbol 
+    outPutPerSymbol(result, symbolLookUp, allSymbols);
     return result;
 }
 
+#ifndef ENGINE_NO_MAIN
 int main()
 {
     int line = 0;
@@ -463,4 +470,5 @@ int main()
         cout << line << endl;
     }
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,400 @@
+/*
+Benchmark of the three generations of the engine with Google Benchmark:
+- basicversio.cpp: one set<StockOrder, customComparator> per symbol and side
+- first_version.cpp: a Book per symbol with a map<pair<float, int>, StockOrder> per side
+- optimized.cpp: the PriceLadder of Limits with intrusive order queues
+
+Build and run:
+    g++ -std=c++17 -O2 -pthread -o benchmark benchmark.cpp -lbenchmark
+    ./benchmark --benchmark_filter=Cancel
+
+Every engine source is compiled into its own namespace (ENGINE_NO_MAIN leaves its main out), and an adapter gives them
+the same interface: apply() feeds one input line, endOfDay() writes the depth of every symbol. The legacy engines
+only have run(), so their adapters keep the state run() keeps in locals and call the same functions run() calls.
+
+Every benchmark builds a fresh book (not timed), then times a batch of operations against it:
+- InsertNoMatch: orders that rest without crossing, on existing and new levels
+- InsertSweep: orders that take out N levels of the opposite side each
+- Cancel: PULL of resting orders
+- Amend: AMEND of resting orders to a new price (the order is removed and inserted again)
+- EndOfDay: the depth output of all the books, one operation per price level
+The arguments are the depth (levels per side and symbol, or levels swept for InsertSweep) and the number of symbols.
+Burst only runs optimized.cpp: MatchingEngine::processBatch on bursts of 64 to 512 decoded commands.
+Next to the time of the batch, ns/op and allocs/op (calls to operator new in the timed part) are reported.
+*/
+#include <bits/stdc++.h>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include <benchmark/benchmark.h>
+
+#define ENGINE_NO_MAIN
+
+namespace basic
+{
+#include "basicversio.cpp"
+}
+
+namespace first
+{
+#include "first_version.cpp"
+}
+
+namespace optimized
+{
+#include "optimized.cpp"
+}
+
+using namespace std;
+
+// Every allocation of the process goes through here, the benchmarks read the count around the timed part
+static size_t allocationCount = 0;
+
+void *operator new(size_t size)
+{
+    allocationCount++;
+    void *memory = malloc(size == 0 ? 1 : size);
+    if (memory == nullptr)
+    {
+        throw bad_alloc();
+    }
+    return memory;
+}
+
+// Both deletes forward to this out-of-line function. Once free is inlined into a caller of delete, GCC pairs it with the
+// new of that caller and warns about a mismatched new and delete (-Wmismatched-new-delete), though the memory did come
+// from malloc in operator new above.
+__attribute__((noinline)) static void releaseMemory(void *memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void *memory) noexcept
+{
+    releaseMemory(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+    releaseMemory(memory);
+}
+
+////////////////////////////////////////////////////////ENGINE ADAPTERS////////////////////////////////////////////////////////
+
+class BasicEngine
+{
+public:
+    void apply(const string &line)
+    {
+        vector<string> command = basic::splitString(line);
+        command.push_back(to_string(timestamp++));
+        if (command[0] == "INSERT")
+        {
+            basic::processInsertQuery(command, result, orderLookUp, symbolLookUp, allSymbols);
+        }
+        else if (command[0] == "AMEND")
+        {
+            basic::processAmendQuery(command, result, orderLookUp, symbolLookUp, allSymbols);
+        }
+        else if (command[0] == "PULL")
+        {
+            basic::processPullQuery(command, orderLookUp, symbolLookUp, allSymbols);
+        }
+    }
+
+    void endOfDay()
+    {
+        basic::outPutPerSymbol(result, symbolLookUp, allSymbols);
+    }
+
+private:
+    vector<string> result;
+    unordered_map<int, basic::StockOrder> orderLookUp;
+    map<string, set<basic::StockOrder, basic::customComparator>> symbolLookUp;
+    set<string> allSymbols;
+    int timestamp = 0;
+};
+
+class FirstEngine
+{
+public:
+    void apply(const string &line)
+    {
+        vector<string> command = first::splitString(line);
+        command.push_back(to_string(timestamp++));
+        if (command[0] == "INSERT")
+        {
+            first::processInsertQuery(command, result, orderLookUp, symbolLookUp, allSymbols);
+        }
+        else if (command[0] == "AMEND")
+        {
+            first::processAmendQuery(command, result, orderLookUp, symbolLookUp, allSymbols);
+        }
+        else if (command[0] == "PULL")
+        {
+            first::processPullQuery(command, orderLookUp, symbolLookUp, allSymbols);
+        }
+    }
+
+    void endOfDay()
+    {
+        first::outPutPerSymbol(result, symbolLookUp, allSymbols);
+    }
+
+private:
+    vector<string> result;
+    unordered_map<int, first::StockOrder> orderLookUp;
+    map<string, first::Book> symbolLookUp;
+    set<string> allSymbols;
+    int timestamp = 0;
+};
+
+// The output goes to a vector<string> like the output of run() of the legacy engines
+class OptimizedEngine
+{
+public:
+    OptimizedEngine() : writer(result), engine(writer) {}
+
+    void apply(const string &line)
+    {
+        engine.processLine(line);
+    }
+
+    void endOfDay()
+    {
+        engine.finish();
+    }
+
+private:
+    vector<string> result;
+    optimized::TextWriter writer;
+    optimized::MatchingEngine engine;
+};
+
+////////////////////////////////////////////////////////WORKLOADS////////////////////////////////////////////////////////
+
+// The bids of a symbol rest at BID_TOP and below, the asks at ASK_BOTTOM and above
+const int BID_TOP = 1000;
+const int ASK_BOTTOM = 1001;
+const int OPERATIONS = 512;
+
+string symbolName(int symbol)
+{
+    return "S" + to_string(symbol);
+}
+
+string insertLine(int orderId, int symbol, const char *side, int price, int volume)
+{
+    return "INSERT," + to_string(orderId) + "," + symbolName(symbol) + "," + side + "," + to_string(price) + "," + to_string(volume);
+}
+
+// One order on each of depth levels per side and symbol, the order ids start at 1 and go symbol by symbol
+vector<string> restingBook(int depth, int symbols)
+{
+    vector<string> lines;
+    int orderId = 1;
+    for (int symbol = 0; symbol < symbols; symbol++)
+    {
+        for (int level = 0; level < depth; level++)
+        {
+            lines.push_back(insertLine(orderId++, symbol, "BUY", BID_TOP - level, 10));
+            lines.push_back(insertLine(orderId++, symbol, "SELL", ASK_BOTTOM + level, 10));
+        }
+    }
+    return lines;
+}
+
+// Build an engine from setup, then time ops. endOfDay is timed after the ops when it is set,
+// operations is the number of operations the timed part counts for.
+template <typename Engine>
+void runWorkload(benchmark::State &state, const vector<string> &setup, const vector<string> &ops, bool endOfDay, size_t operations)
+{
+    size_t totalOperations = 0;
+    size_t totalAllocations = 0;
+    double totalSeconds = 0;
+    for (auto _ : state)
+    {
+        Engine engine;
+        for (const string &line : setup)
+        {
+            engine.apply(line);
+        }
+        size_t allocationsBefore = allocationCount;
+        auto start = chrono::high_resolution_clock::now();
+        for (const string &line : ops)
+        {
+            engine.apply(line);
+        }
+        if (endOfDay)
+        {
+            engine.endOfDay();
+        }
+        double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+        totalAllocations += allocationCount - allocationsBefore;
+        totalSeconds += seconds;
+        totalOperations += operations;
+        state.SetIterationTime(seconds);
+        // The engine is destroyed outside of the timed part
+    }
+    state.counters["ns/op"] = totalSeconds * 1e9 / max<size_t>(totalOperations, 1);
+    state.counters["allocs/op"] = (double)totalAllocations / max<size_t>(totalOperations, 1);
+}
+
+template <typename Engine>
+void InsertNoMatch(benchmark::State &state)
+{
+    int depth = (int)state.range(0);
+    int symbols = (int)state.range(1);
+    vector<string> ops;
+    mt19937 random(1);
+    int orderId = 2 * depth * symbols + 1;
+    for (int i = 0; i < OPERATIONS; i++)
+    {
+        // Half of the orders join an existing level, the other half open a level behind the book
+        int symbol = random() % symbols;
+        int level = i % 2 == 0 ? random() % depth : depth + random() % depth;
+        if (random() % 2 == 0)
+        {
+            ops.push_back(insertLine(orderId++, symbol, "BUY", BID_TOP - level, 10));
+        }
+        else
+        {
+            ops.push_back(insertLine(orderId++, symbol, "SELL", ASK_BOTTOM + level, 10));
+        }
+    }
+    runWorkload<Engine>(state, restingBook(depth, symbols), ops, false, ops.size());
+}
+
+template <typename Engine>
+void InsertSweep(benchmark::State &state)
+{
+    int levels = (int)state.range(0);
+    int symbols = (int)state.range(1);
+    // Every symbol has enough asks for its share of the operations, each operation takes out the best levels asks
+    int perSymbol = (OPERATIONS + symbols - 1) / symbols;
+    vector<string> setup = restingBook(levels * perSymbol, symbols);
+    vector<string> ops;
+    int orderId = (int)setup.size() + 1;
+    for (int i = 0; i < OPERATIONS; i++)
+    {
+        int symbol = i % symbols;
+        int round = i / symbols;
+        int price = ASK_BOTTOM + (round + 1) * levels - 1;
+        ops.push_back(insertLine(orderId++, symbol, "BUY", price, 10 * levels));
+    }
+    runWorkload<Engine>(state, setup, ops, false, ops.size());
+}
+
+// The order ids of the resting book in a random order, so the cancels and amends hit every level
+vector<int> shuffledOrders(int depth, int symbols)
+{
+    vector<int> orderIds(2 * depth * symbols);
+    iota(orderIds.begin(), orderIds.end(), 1);
+    shuffle(orderIds.begin(), orderIds.end(), mt19937(2));
+    orderIds.resize(min<size_t>(orderIds.size(), OPERATIONS));
+    return orderIds;
+}
+
+template <typename Engine>
+void Cancel(benchmark::State &state)
+{
+    int depth = (int)state.range(0);
+    int symbols = (int)state.range(1);
+    vector<string> ops;
+    for (int orderId : shuffledOrders(depth, symbols))
+    {
+        ops.push_back("PULL," + to_string(orderId));
+    }
+    runWorkload<Engine>(state, restingBook(depth, symbols), ops, false, ops.size());
+}
+
+template <typename Engine>
+void Amend(benchmark::State &state)
+{
+    int depth = (int)state.range(0);
+    int symbols = (int)state.range(1);
+    vector<string> ops;
+    for (int orderId : shuffledOrders(depth, symbols))
+    {
+        // restingBook gives the buys the odd ids, every order moves one level away from the touch
+        int level = (orderId - 1) / 2 % depth;
+        int price = orderId % 2 == 1 ? BID_TOP - level - 1 : ASK_BOTTOM + level + 1;
+        ops.push_back("AMEND," + to_string(orderId) + "," + to_string(price) + ",10");
+    }
+    runWorkload<Engine>(state, restingBook(depth, symbols), ops, false, ops.size());
+}
+
+template <typename Engine>
+void EndOfDay(benchmark::State &state)
+{
+    int depth = (int)state.range(0);
+    int symbols = (int)state.range(1);
+    runWorkload<Engine>(state, restingBook(depth, symbols), vector<string>(), true, 2 * (size_t)depth * symbols);
+}
+
+// Bursts of range(0) decoded commands through MatchingEngine::processBatch. The fills of all the bursts are appended to one
+// vector, like a gateway that collects them. Every second command crosses the one before it, so half of the commands fill.
+void Burst(benchmark::State &state)
+{
+    size_t burst = (size_t)state.range(0);
+    const size_t commandCount = 1 << 14;
+    vector<optimized::Command> commands(commandCount);
+    for (size_t i = 0; i < commandCount; i++)
+    {
+        optimized::parseCommand(insertLine((int)i + 1, 0, i % 2 == 0 ? "BUY" : "SELL", BID_TOP, 10), commands[i]);
+    }
+    size_t totalOperations = 0;
+    size_t totalAllocations = 0;
+    double totalSeconds = 0;
+    for (auto _ : state)
+    {
+        vector<string> result;
+        optimized::TextWriter writer(result);
+        optimized::MatchingEngine engine(writer);
+        vector<optimized::MatchedOrders> fills;
+        size_t allocationsBefore = allocationCount;
+        auto start = chrono::high_resolution_clock::now();
+        for (size_t first = 0; first < commandCount; first += burst)
+        {
+            engine.processBatch(commands.data() + first, min(burst, commandCount - first), fills);
+        }
+        double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+        totalAllocations += allocationCount - allocationsBefore;
+        totalSeconds += seconds;
+        totalOperations += commandCount;
+        state.SetIterationTime(seconds);
+    }
+    state.counters["ns/op"] = totalSeconds * 1e9 / max<size_t>(totalOperations, 1);
+    state.counters["allocs/op"] = (double)totalAllocations / max<size_t>(totalOperations, 1);
+}
+
+// depth (or levels swept) x symbols
+void bookShapes(benchmark::internal::Benchmark *benchmark)
+{
+    benchmark->ArgNames({"depth", "symbols"});
+    for (int depth : {1, 16, 256})
+    {
+        for (int symbols : {1, 64})
+        {
+            benchmark->Args({depth, symbols});
+        }
+    }
+    benchmark->UseManualTime();
+}
+
+#define ENGINE_BENCHMARK(workload)                                   \
+    BENCHMARK_TEMPLATE(workload, BasicEngine)->Apply(bookShapes);     \
+    BENCHMARK_TEMPLATE(workload, FirstEngine)->Apply(bookShapes);     \
+    BENCHMARK_TEMPLATE(workload, OptimizedEngine)->Apply(bookShapes);
+
+ENGINE_BENCHMARK(InsertNoMatch)
+ENGINE_BENCHMARK(InsertSweep)
+ENGINE_BENCHMARK(Cancel)
+ENGINE_BENCHMARK(Amend)
+ENGINE_BENCHMARK(EndOfDay)
+BENCHMARK(Burst)->ArgName("burst")->Arg(64)->Arg(128)->Arg(256)->Arg(512)->UseManualTime();
+
+BENCHMARK_MAIN();
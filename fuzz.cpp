@@ -0,0 +1,806 @@
+/*
+Differential fuzzing of the engines: the same command stream goes to run() of every engine, and the trades and the final
+depth have to be the same line for line.
+The oracle is the reference matcher below (namespace reference): a naive engine that scans every resting order for each
+fill and knows every order type (IOC, FOK, market, iceberg, stop, self-trade prevention). It checks the rules.
+optimized.cpp is also compiled three times with a different LADDER_BAND_TICKS:
+- 512, the default: the levels near the touch are in the dense ladder, the others in the outlier map
+- 0: every level is in the map (the tree mode)
+- 1 << 16: every level of the fuzz prices fits in the dense ladder
+These three share the matching code but not the level storage, which is where a performance change is most likely to break.
+The market data of optimized.cpp is checked on the same stream (see checkMarketData): the cached top of the book, depth(n)
+and the L2 updates have to agree with each other after every command and with the end of day depth.
+
+With -DFUZZ_LEGACY basicversio.cpp and first_version.cpp are compared too. They are not a reliable reference:
+first_version looks up an amended sell order in the buy tree and can leave a fully filled order resting, and basicversio
+crashes on some streams. Use it to look at how the generations differ, not as a gate.
+
+Build and run the standalone driver (random inputs from a seed, the first difference is printed with its input):
+    g++ -std=c++17 -O2 -pthread -o fuzz fuzz.cpp
+    ./fuzz 100000 1               iterations, seed
+
+Build for libFuzzer (clang), a difference aborts:
+    clang++ -std=c++17 -O1 -g -pthread -fsanitize=fuzzer,address -DFUZZ_WITH_LIBFUZZER -o fuzz fuzz.cpp
+    ./fuzz corpus/
+
+The fuzz input is a byte string that is decoded into commands, so every input is a valid command stream and the fuzzer
+spends its time on the matching and not on the parser:
+- INSERT gets a new order id, AMEND and PULL pick any id seen so far (or one that never existed). Without FUZZ_LEGACY an
+  AMEND can have the volume 0, which is not a valid command
+- without FUZZ_LEGACY an INSERT can be IOC, FOK, a market order, an iceberg or a stop order, with an owner and a self-trade
+  prevention mode (the legacy engines only know limit orders)
+- an iceberg can have a volume and a clip of more than 65535, the clip is a full int
+- there are 3 symbols and 16 prices 0.01 apart (100 ticks, so some of them share the dense band and some do not).
+  The legacy engines keep prices in a float and print them with <<, so the prices have few significant digits.
+*/
+#include <bits/stdc++.h>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define ENGINE_NO_MAIN
+
+#ifdef FUZZ_LEGACY
+namespace basic
+{
+#include "basicversio.cpp"
+}
+
+namespace first
+{
+#include "first_version.cpp"
+}
+#endif
+
+#undef LADDER_BAND_TICKS
+#define LADDER_BAND_TICKS 512
+namespace optimized
+{
+#include "optimized.cpp"
+}
+
+#undef LADDER_BAND_TICKS
+#define LADDER_BAND_TICKS 0
+namespace optimized_tree
+{
+#include "optimized.cpp"
+}
+
+#undef LADDER_BAND_TICKS
+#define LADDER_BAND_TICKS (1 << 16)
+namespace optimized_dense
+{
+#include "optimized.cpp"
+}
+
+using namespace std;
+
+// The reference matcher is the oracle of the fuzzer. It implements the rules of the engine again in the most direct way,
+// without anything that optimized.cpp does for speed: every resting order of every symbol is in one vector, the next
+// passive order is found by scanning all of them, and a FOK order is matched on a copy of the book that is thrown away if
+// the order does not fill. It is slow, but short enough to check against the rules by reading it.
+namespace reference
+{
+const int64_t MARKET_BUY = INT64_MAX;
+const int64_t MARKET_SELL = INT64_MIN;
+enum TimeInForce { GTC, IOC, FOK };
+enum Mode { NEWEST, OLDEST, BOTH, DECREMENT };
+
+class Order
+{
+public:
+    int orderId = 0;
+    string symbol;
+    bool buy = false;
+    int64_t price = 0;
+    // The shown volume, and for an iceberg the clip size and the volume in reserve
+    int volume = 0;
+    int display = 0;
+    int hidden = 0;
+    TimeInForce timeInForce = GTC;
+    int owner = 0;
+    Mode mode = NEWEST;
+    bool stop = false;
+    int64_t stopPrice = 0;
+    // Time priority: the position in the queue for a resting order, the insert timestamp for a waiting stop
+    long long sequence = 0;
+};
+
+// "10.05" is 100500 ticks, like PRICE_DECIMALS = 4
+int64_t ticksOf(const string &price)
+{
+    size_t dot = price.find('.');
+    int64_t ticks = stoll(price.substr(0, dot)) * 10000;
+    if (dot != string::npos)
+    {
+        string fraction = (price.substr(dot + 1) + "0000").substr(0, 4);
+        ticks += stoll(fraction);
+    }
+    return ticks;
+}
+
+string formatTicks(int64_t ticks)
+{
+    string text = to_string(ticks / 10000);
+    if (ticks % 10000 != 0)
+    {
+        string fraction = to_string(10000 + ticks % 10000).substr(1);
+        text += "." + fraction.substr(0, fraction.find_last_not_of('0') + 1);
+    }
+    return text;
+}
+
+vector<string> split(const string &line)
+{
+    vector<string> fields;
+    stringstream stream(line);
+    string field;
+    while (getline(stream, field, ','))
+    {
+        fields.push_back(field);
+    }
+    return fields;
+}
+
+class Engine
+{
+public:
+    vector<string> run(const vector<string> &commands)
+    {
+        for (size_t i = 0; i < commands.size(); i++)
+        {
+            vector<string> fields = split(commands[i]);
+            // An INSERT or an AMEND without a positive volume is not a command
+            if ((fields[0] == "INSERT" && stoi(fields[5]) <= 0) || (fields[0] == "AMEND" && stoi(fields[3]) <= 0))
+            {
+                continue;
+            }
+            if (fields[0] == "INSERT")
+            {
+                insert(fields, (long long)i);
+            }
+            else if (fields[0] == "AMEND")
+            {
+                amend(stoi(fields[1]), ticksOf(fields[2]), stoi(fields[3]), (long long)i);
+            }
+            else if (fields[0] == "PULL")
+            {
+                int orderId = stoi(fields[1]);
+                int found = findResting(orderId);
+                if (found >= 0)
+                {
+                    resting.erase(resting.begin() + found);
+                }
+                found = findStop(orderId);
+                if (found >= 0)
+                {
+                    stops.erase(stops.begin() + found);
+                }
+            }
+        }
+        writeDepth();
+        return output;
+    }
+
+private:
+    vector<Order> resting;
+    vector<Order> stops;
+    set<string> symbols;
+    vector<string> output;
+    // The prices of the trades of the current command, they trigger the stops
+    vector<int64_t> tradePrices;
+    long long sequence = 0;
+
+    void insert(const vector<string> &fields, long long timestamp)
+    {
+        Order order;
+        order.orderId = stoi(fields[1]);
+        order.symbol = fields[2];
+        order.buy = fields[3] == "BUY";
+        bool market = fields[4] == "MARKET";
+        order.price = market ? (order.buy ? MARKET_BUY : MARKET_SELL) : ticksOf(fields[4]);
+        order.volume = stoi(fields[5]);
+        order.timeInForce = market ? IOC : GTC;
+        for (size_t i = 6; i < fields.size(); i++)
+        {
+            const string &option = fields[i];
+            if (option == "IOC")
+                order.timeInForce = IOC;
+            else if (option == "FOK")
+                order.timeInForce = FOK;
+            else if (option == "GTC")
+                order.timeInForce = market ? IOC : GTC;
+            else if (option.rfind("DISPLAY=", 0) == 0)
+                order.display = stoi(option.substr(8));
+            else if (option.rfind("STOP=", 0) == 0)
+            {
+                order.stop = true;
+                order.stopPrice = ticksOf(option.substr(5));
+            }
+            else if (option.rfind("OWNER=", 0) == 0)
+                order.owner = stoi(option.substr(6));
+            else if (option.rfind("STP=", 0) == 0)
+            {
+                static const map<string, Mode> modes = {{"NEWEST", NEWEST}, {"OLDEST", OLDEST}, {"BOTH", BOTH}, {"DECREMENT", DECREMENT}};
+                order.mode = modes.at(option.substr(4));
+            }
+        }
+        symbols.insert(order.symbol);
+        if (order.stop)
+        {
+            order.sequence = timestamp;
+            stops.push_back(order);
+            return;
+        }
+        execute(order);
+    }
+
+    void amend(int orderId, int64_t price, int volume, long long timestamp)
+    {
+        int found = findStop(orderId);
+        if (found >= 0)
+        {
+            // A stop market order stays one, a stop loses its place unless only its volume goes down
+            Order &stop = stops[found];
+            bool market = stop.price == MARKET_BUY || stop.price == MARKET_SELL;
+            if (!((market || stop.price == price) && volume <= stop.volume))
+            {
+                stop.sequence = timestamp;
+            }
+            if (!market)
+            {
+                stop.price = price;
+            }
+            stop.volume = volume;
+            return;
+        }
+        found = findResting(orderId);
+        if (found < 0)
+        {
+            return;
+        }
+        Order order = resting[found];
+        if (order.price == price && volume <= order.volume + order.hidden)
+        {
+            // Only a smaller volume at the same price keeps the place in the queue, the reserve goes first
+            resting[found].volume = min(order.volume, volume);
+            resting[found].hidden = volume - resting[found].volume;
+            return;
+        }
+        resting.erase(resting.begin() + found);
+        order.price = price;
+        order.volume = volume;
+        order.hidden = 0;
+        order.timeInForce = GTC;
+        execute(order);
+    }
+
+    // Match an incoming order, then the stops its trades trigger, round by round
+    void execute(Order &order)
+    {
+        tradePrices.clear();
+        match(order);
+        size_t checked = 0;
+        while (checked < tradePrices.size())
+        {
+            int64_t low = *min_element(tradePrices.begin() + checked, tradePrices.end());
+            int64_t high = *max_element(tradePrices.begin() + checked, tradePrices.end());
+            checked = tradePrices.size();
+            // The buy stops at or below the highest trade from the lowest stop price, then the sell stops at or above the
+            // lowest trade from the highest stop price, the older one first at the same stop price
+            vector<Order> buys, sells;
+            for (size_t i = 0; i < stops.size();)
+            {
+                Order &stop = stops[i];
+                if (stop.symbol == order.symbol && (stop.buy ? stop.stopPrice <= high : stop.stopPrice >= low))
+                {
+                    (stop.buy ? buys : sells).push_back(stop);
+                    stops.erase(stops.begin() + i);
+                }
+                else
+                {
+                    i++;
+                }
+            }
+            sort(buys.begin(), buys.end(), [](const Order &a, const Order &b) { return make_pair(a.stopPrice, a.sequence) < make_pair(b.stopPrice, b.sequence); });
+            sort(sells.begin(), sells.end(), [](const Order &a, const Order &b) { return make_pair(-a.stopPrice, a.sequence) < make_pair(-b.stopPrice, b.sequence); });
+            buys.insert(buys.end(), sells.begin(), sells.end());
+            for (Order &triggered : buys)
+            {
+                match(triggered);
+            }
+        }
+    }
+
+    // Match one order against the book and rest its remainder
+    void match(Order &order)
+    {
+        if (order.timeInForce == FOK)
+        {
+            vector<Order> savedResting = resting;
+            size_t savedOutput = output.size();
+            size_t savedTrades = tradePrices.size();
+            Order copy = order;
+            int traded = fill(copy);
+            resting = savedResting;
+            output.resize(savedOutput);
+            tradePrices.resize(savedTrades);
+            if (traded < order.volume)
+            {
+                return;
+            }
+        }
+        fill(order);
+        if (order.volume > 0 && order.timeInForce == GTC)
+        {
+            if (order.display > 0 && order.volume > order.display)
+            {
+                order.hidden = order.volume - order.display;
+                order.volume = order.display;
+            }
+            else
+            {
+                order.display = 0;
+            }
+            order.sequence = sequence++;
+            resting.push_back(order);
+        }
+    }
+
+    // Trade the order against the best passive orders while it crosses, return the traded volume
+    int fill(Order &order)
+    {
+        int traded = 0;
+        while (order.volume > 0)
+        {
+            int best = -1;
+            for (size_t i = 0; i < resting.size(); i++)
+            {
+                const Order &passive = resting[i];
+                if (passive.symbol != order.symbol || passive.buy == order.buy || (order.buy ? passive.price > order.price : passive.price < order.price))
+                {
+                    continue;
+                }
+                if (best < 0 || (passive.price != resting[best].price ? (order.buy ? passive.price < resting[best].price : passive.price > resting[best].price)
+                                                                      : passive.sequence < resting[best].sequence))
+                {
+                    best = (int)i;
+                }
+            }
+            if (best < 0)
+            {
+                break;
+            }
+            Order &passive = resting[best];
+            bool passiveDone = false;
+            if (order.owner != 0 && passive.owner == order.owner)
+            {
+                if (order.mode == DECREMENT)
+                {
+                    int decrement = min(order.volume, passive.volume);
+                    order.volume -= decrement;
+                    passive.volume -= decrement;
+                    passiveDone = passive.volume == 0;
+                }
+                else
+                {
+                    if (order.mode != OLDEST)
+                    {
+                        order.volume = 0;
+                    }
+                    if (order.mode != NEWEST)
+                    {
+                        resting.erase(resting.begin() + best);
+                    }
+                    continue;
+                }
+            }
+            else
+            {
+                int volume = min(order.volume, passive.volume);
+                order.volume -= volume;
+                passive.volume -= volume;
+                traded += volume;
+                tradePrices.push_back(passive.price);
+                output.push_back(order.symbol + "," + formatTicks(passive.price) + "," + to_string(volume) + "," + to_string(order.orderId) + "," +
+                                 to_string(passive.orderId));
+                passiveDone = passive.volume == 0;
+            }
+            if (passiveDone && passive.hidden > 0)
+            {
+                // The next clip of the iceberg goes to the back of the queue
+                passive.volume = min(passive.display, passive.hidden);
+                passive.hidden -= passive.volume;
+                passive.sequence = sequence++;
+            }
+            else if (passiveDone)
+            {
+                resting.erase(resting.begin() + best);
+            }
+        }
+        return traded;
+    }
+
+    int findResting(int orderId) const
+    {
+        for (size_t i = 0; i < resting.size(); i++)
+        {
+            if (resting[i].orderId == orderId)
+            {
+                return (int)i;
+            }
+        }
+        return -1;
+    }
+
+    int findStop(int orderId) const
+    {
+        for (size_t i = 0; i < stops.size(); i++)
+        {
+            if (stops[i].orderId == orderId)
+            {
+                return (int)i;
+            }
+        }
+        return -1;
+    }
+
+    // The shown volume of every price, the bids from the highest price and the asks from the lowest, row by row
+    void writeDepth()
+    {
+        for (const string &symbol : symbols)
+        {
+            map<int64_t, int, greater<int64_t>> bids;
+            map<int64_t, int> asks;
+            for (const Order &order : resting)
+            {
+                if (order.symbol == symbol)
+                {
+                    if (order.buy)
+                        bids[order.price] += order.volume;
+                    else
+                        asks[order.price] += order.volume;
+                }
+            }
+            if (bids.empty() && asks.empty())
+            {
+                continue;
+            }
+            output.push_back("===" + symbol + "===");
+            auto bid = bids.begin();
+            auto ask = asks.begin();
+            while (bid != bids.end() || ask != asks.end())
+            {
+                string row = bid != bids.end() ? formatTicks(bid->first) + "," + to_string(bid->second) : ",";
+                row += "," + (ask != asks.end() ? formatTicks(ask->first) + "," + to_string(ask->second) : ",");
+                output.push_back(row);
+                if (bid != bids.end())
+                    bid++;
+                if (ask != asks.end())
+                    ask++;
+            }
+        }
+    }
+};
+}
+
+// MarketDataCheck is the sink of checkMarketData. It replays the L2 updates into the levels of every book and keeps the
+// end of day depth rows, so both can be compared with the queries of the engine.
+class MarketDataCheck : public optimized::EventSink
+{
+public:
+    vector<string> names;
+    // The levels of every (symbol, side) after the L2 updates seen so far, by price
+    map<pair<uint32_t, int>, map<int64_t, optimized::BookLevel>> replayed;
+    // The end of day depth of every (symbol, side), from the best level to the worst one
+    map<pair<uint32_t, int>, vector<optimized::BookLevel>> depthRows;
+
+    void onSymbol(uint32_t symbolId, const string &symbol) override
+    {
+        names.resize(max<size_t>(names.size(), symbolId + 1));
+        names[symbolId] = symbol;
+    }
+    void onTrade(const optimized::MatchedOrders &) override {}
+    void onBookHeader(uint32_t) override {}
+    void onDepthRow(uint32_t symbolId, const optimized::Limit *bid, const optimized::Limit *ask) override
+    {
+        if (bid != nullptr)
+        {
+            depthRows[{symbolId, optimized::BUY}].push_back({symbolId, optimized::BUY, bid->limitPrice, bid->totalVolume, bid->size});
+        }
+        if (ask != nullptr)
+        {
+            depthRows[{symbolId, optimized::SELL}].push_back({symbolId, optimized::SELL, ask->limitPrice, ask->totalVolume, ask->size});
+        }
+    }
+    void onLevelChange(const optimized::BookLevel &level) override
+    {
+        map<int64_t, optimized::BookLevel> &levels = replayed[{level.symbolId, level.side}];
+        if (level.volume == 0)
+        {
+            levels.erase(level.price);
+        }
+        else
+        {
+            levels[level.price] = level;
+        }
+    }
+
+    // The replayed levels of one side from the best price to the worst one
+    vector<optimized::BookLevel> replayedDepth(uint32_t symbolId, optimized::Side side)
+    {
+        vector<optimized::BookLevel> levels;
+        for (const auto &level : replayed[{symbolId, side}])
+        {
+            levels.push_back(level.second);
+        }
+        if (side == optimized::BUY)
+        {
+            reverse(levels.begin(), levels.end());
+        }
+        return levels;
+    }
+};
+
+bool sameLevels(const vector<optimized::BookLevel> &a, const vector<optimized::BookLevel> &b)
+{
+    return equal(a.begin(), a.end(), b.begin(), b.end(), [](const optimized::BookLevel &x, const optimized::BookLevel &y) {
+        return x.symbolId == y.symbolId && x.side == y.side && x.price == y.price && x.volume == y.volume && x.orders == y.orders;
+    });
+}
+
+// Run optimized.cpp with L2 updates on the commands and check its market data. After every command, for both sides of every
+// book (found with bookOf): topBid / topAsk is depth(side, 1) and depth(side, n) is the replayed L2 stream. At the end of
+// day the depth rows are depth(side, n) again. Return what differs first, or an empty string.
+string checkMarketData(const vector<string> &commands)
+{
+    MarketDataCheck check;
+    optimized::MatchingEngine engine(check, true);
+    vector<optimized::BookLevel> top, levels;
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        engine.processLine(commands[i]);
+        for (uint32_t symbolId = 0; symbolId < check.names.size(); symbolId++)
+        {
+            optimized::LimitBook *book = engine.bookOf(check.names[symbolId]);
+            if (book == nullptr || book->symbolId != symbolId)
+            {
+                return "bookOf(" + check.names[symbolId] + ") after command " + to_string(i);
+            }
+            for (optimized::Side side : {optimized::BUY, optimized::SELL})
+            {
+                book->depth(side, 1, top);
+                optimized::BookLevel cached = side == optimized::BUY ? book->topBid : book->topAsk;
+                if (!sameLevels({cached}, top.empty() ? vector<optimized::BookLevel>{{symbolId, side, 0, 0, 0}} : top))
+                {
+                    return "the top of " + check.names[symbolId] + " is not depth(1) after command " + to_string(i);
+                }
+                book->depth(side, SIZE_MAX, levels);
+                if (!sameLevels(levels, check.replayedDepth(symbolId, side)))
+                {
+                    return "the L2 updates of " + check.names[symbolId] + " are not depth(n) after command " + to_string(i);
+                }
+            }
+        }
+    }
+    engine.finish();
+    for (uint32_t symbolId = 0; symbolId < check.names.size(); symbolId++)
+    {
+        for (optimized::Side side : {optimized::BUY, optimized::SELL})
+        {
+            engine.books[symbolId].depth(side, SIZE_MAX, levels);
+            if (!sameLevels(levels, check.depthRows[{symbolId, side}]))
+            {
+                return "the end of day depth of " + check.names[symbolId] + " is not depth(n)";
+            }
+        }
+    }
+    return "";
+}
+
+// Reads the fuzz input one byte at a time, past the end every byte is 0
+class ByteReader
+{
+public:
+    ByteReader(const uint8_t *data, size_t size)
+    {
+        this->data = data;
+        this->size = size;
+        this->position = 0;
+    }
+
+    bool done() const
+    {
+        return position >= size;
+    }
+
+    uint8_t next()
+    {
+        return position < size ? data[position++] : 0;
+    }
+
+private:
+    const uint8_t *data;
+    size_t size;
+    size_t position;
+};
+
+string priceOf(uint8_t byte)
+{
+    int cents = byte % 16;
+    return cents == 0 ? "10" : cents % 10 == 0 ? "10." + to_string(cents / 10) : "10." + string(cents < 10 ? "0" : "") + to_string(cents);
+}
+
+vector<string> decodeCommands(const uint8_t *data, size_t size)
+{
+    static const char *symbols[3] = {"AAA", "BB", "C"};
+    ByteReader reader(data, size);
+    vector<string> commands;
+    int nextOrderId = 1;
+    while (!reader.done() && commands.size() < 2000)
+    {
+        uint8_t operation = reader.next() % 8;
+        if (operation < 5 || nextOrderId == 1)
+        {
+            uint8_t flags = reader.next();
+            string price = priceOf(reader.next());
+            string timeInForce;
+            int volumeScale = 1;
+#ifndef FUZZ_LEGACY
+            static const char *timesInForce[8] = {"", "", "", "", ",GTC", ",IOC", ",FOK", ",FOK"};
+            timeInForce = timesInForce[(flags >> 3) & 7];
+            if ((flags >> 6) == 3)
+            {
+                price = "MARKET";
+            }
+            uint8_t iceberg = reader.next();
+            if (iceberg % 4 == 0)
+            {
+                // Some icebergs have a volume and a clip above 16 bits
+                volumeScale = iceberg >= 128 ? 1 << 16 : 1;
+                timeInForce += ",DISPLAY=" + to_string((1 + iceberg / 4 % 5) * volumeScale);
+            }
+            if (iceberg % 4 == 1)
+            {
+                timeInForce += ",STOP=" + priceOf(iceberg / 4);
+            }
+            uint8_t owner = reader.next();
+            if (owner % 2 == 0)
+            {
+                static const char *modes[4] = {"NEWEST", "OLDEST", "BOTH", "DECREMENT"};
+                timeInForce += ",OWNER=" + to_string(1 + owner / 2 % 3) + ",STP=" + modes[owner / 8 % 4];
+            }
+#endif
+            commands.push_back("INSERT," + to_string(nextOrderId++) + "," + symbols[flags % 3] + "," + ((flags & 4) ? "BUY" : "SELL") + "," +
+                               price + "," + to_string((1 + reader.next() % 20) * volumeScale) + timeInForce);
+        }
+        else if (operation < 7)
+        {
+            int orderId = 1 + reader.next() % nextOrderId;
+#ifdef FUZZ_LEGACY
+            int volume = 1 + reader.next() % 20;
+#else
+            // An AMEND to 0 is not a valid command, the engines have to ignore it
+            int volume = reader.next() % 21;
+#endif
+            commands.push_back("AMEND," + to_string(orderId) + "," + priceOf(reader.next()) + "," + to_string(volume));
+        }
+        else
+        {
+            int orderId = 1 + reader.next() % nextOrderId;
+            commands.push_back("PULL," + to_string(orderId));
+        }
+    }
+    return commands;
+}
+
+// Run every engine on the commands, return the name of the first engine that differs from optimized.cpp (or nullptr).
+// When the engines agree, the market data of optimized.cpp is checked; if it differs, actual is what differs.
+// The engines report an invalid AMEND or PULL on cout or cerr, that is muted while they run.
+const char *findDifference(const vector<string> &commands, vector<string> &expected, vector<string> &actual)
+{
+    streambuf *coutBuffer = cout.rdbuf(nullptr);
+    streambuf *cerrBuffer = cerr.rdbuf(nullptr);
+    const char *engine = nullptr;
+    expected = optimized::run(commands);
+    if ((actual = reference::Engine().run(commands)) != expected)
+    {
+        engine = "the reference matcher";
+    }
+    else if ((actual = optimized_tree::run(commands)) != expected)
+    {
+        engine = "optimized (tree mode)";
+    }
+    else if ((actual = optimized_dense::run(commands)) != expected)
+    {
+        engine = "optimized (dense ladder)";
+    }
+#ifdef FUZZ_LEGACY
+    else if ((actual = first::run(commands)) != expected)
+    {
+        engine = "first_version";
+    }
+    else if ((actual = basic::run(commands)) != expected)
+    {
+        engine = "basicversio";
+    }
+#endif
+    else
+    {
+        string marketData = checkMarketData(commands);
+        if (!marketData.empty())
+        {
+            engine = "the market data queries";
+            actual = {marketData};
+        }
+    }
+    cout.rdbuf(coutBuffer);
+    cerr.rdbuf(cerrBuffer);
+    return engine;
+}
+
+void printDifference(const char *engine, const vector<string> &commands, const vector<string> &expected, const vector<string> &actual)
+{
+    cerr << "optimized and " << engine << " differ on" << endl;
+    cerr << commands.size() << endl;
+    for (const string &command : commands)
+    {
+        cerr << command << endl;
+    }
+    cerr << "--- optimized" << endl;
+    for (const string &line : expected)
+    {
+        cerr << line << endl;
+    }
+    cerr << "--- " << engine << endl;
+    for (const string &line : actual)
+    {
+        cerr << line << endl;
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    vector<string> commands = decodeCommands(data, size);
+    vector<string> expected, actual;
+    const char *engine = findDifference(commands, expected, actual);
+    if (engine != nullptr)
+    {
+        printDifference(engine, commands, expected, actual);
+        abort();
+    }
+    return 0;
+}
+
+#ifndef FUZZ_WITH_LIBFUZZER
+// Standalone driver: random inputs of up to 512 bytes, stops at the first difference
+int main(int argc, char *argv[])
+{
+    long long iterations = argc > 1 ? atoll(argv[1]) : 10000;
+    uint64_t seed = argc > 2 ? strtoull(argv[2], nullptr, 10) : 1;
+    mt19937_64 random(seed);
+    vector<uint8_t> input;
+    for (long long i = 0; i < iterations; i++)
+    {
+        input.resize(1 + random() % 512);
+        for (uint8_t &byte : input)
+        {
+            byte = (uint8_t)random();
+        }
+        vector<string> commands = decodeCommands(input.data(), input.size());
+        vector<string> expected, actual;
+        const char *engine = findDifference(commands, expected, actual);
+        if (engine != nullptr)
+        {
+            cerr << "iteration " << i << ": ";
+            printDifference(engine, commands, expected, actual);
+            return 1;
+        }
+    }
+    cerr << iterations << " inputs, no difference" << endl;
+    return 0;
+}
+#endif
@@ -0,0 +1,594 @@
+/*
+Order flow generator for load tests and regressions.
+It writes a stream of INSERT / AMEND / PULL commands in the input format of the engines: the number of commands on the
+first line, then one command per line. The same options and seed always give the same stream, on every platform:
+the random numbers come from mt19937_64 and the distributions are computed here, not taken from <random>.
+
+Build and run:
+    g++ -std=c++17 -O2 -o generator generator.cpp
+    ./generator --messages 1000000 --symbols 500 --seed 7 > orders.txt
+    ./generator --messages 5000000000 --no-count | ./optimized --stream
+
+Options (default in brackets):
+    --messages N        number of commands [1000000]
+    --seed N            seed of the random numbers [1]
+    --symbols N         number of symbols [100]
+    --zipf S            exponent of the Zipf popularity of the symbols, 0 is uniform [1.0]
+    --cancel-ratio R    fraction of the commands that are a PULL [0.3]
+    --amend-ratio R     fraction of the commands that are an AMEND [0.1]
+    --volatility V      standard deviation of the move of the mid price per command on a symbol, in ticks [0.5]
+    --marketable R      fraction of the inserts priced through the mid, they are likely to trade [0.1]
+    --depth N           mean distance of a passive insert from the mid, in ticks [10]
+    --size-mean N       median order size [100]
+    --size-sigma S      sigma of the log-normal order size, 0 gives the same size every time [1.0]
+    --lot N             order sizes are a multiple of the lot [1]
+    --tick T            price tick [0.01]
+    --start-price P     first mid price of every symbol [100]
+    --no-count          leave out the count line (for --stream input that does not end)
+    --out PATH          write to PATH instead of stdout
+
+The memory does not grow with the number of commands: every symbol keeps its mid price, and the orders that AMEND and
+PULL pick from are a bounded pool of recent passive inserts. The generator does not match, so it does not know the fills:
+an order leaves the pool when the mid of its symbol reaches its price, it has most likely traded by then. The guess is
+not exact (a marketable insert also takes orders the mid has not reached), an order of the pool that has traded gives an
+invalid request in the engine, like a late cancel in production.
+Order ids are positive ints, after 2^31 - 1 inserts they start again at 1.
+*/
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <charconv>
+#include <bits/stdc++.h>
+using namespace std;
+
+// Random numbers that are the same on every platform
+class Random
+{
+public:
+    Random(uint64_t seed) : engine(seed) {}
+
+    // Uniform in [0, 1)
+    double uniform()
+    {
+        return (engine() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    // Uniform in [0, n)
+    uint64_t below(uint64_t n)
+    {
+        return (uint64_t)(uniform() * n);
+    }
+
+    // Standard normal with the Box-Muller transform
+    double normal()
+    {
+        if (hasSpare)
+        {
+            hasSpare = false;
+            return spare;
+        }
+        double u1 = 1.0 - uniform();
+        double u2 = uniform();
+        double radius = sqrt(-2.0 * log(u1));
+        spare = radius * sin(2 * M_PI * u2);
+        hasSpare = true;
+        return radius * cos(2 * M_PI * u2);
+    }
+
+    // Geometric number of failures before a success with mean `mean`
+    int64_t geometric(double mean)
+    {
+        if (mean <= 0)
+        {
+            return 0;
+        }
+        double p = 1.0 / (mean + 1.0);
+        return (int64_t)floor(log(1.0 - uniform()) / log(1.0 - p));
+    }
+
+private:
+    mt19937_64 engine;
+    bool hasSpare = false;
+    double spare = 0;
+};
+
+class Options
+{
+public:
+    uint64_t messages = 1000000;
+    uint64_t seed = 1;
+    int symbols = 100;
+    double zipf = 1.0;
+    double cancelRatio = 0.3;
+    double amendRatio = 0.1;
+    double volatility = 0.5;
+    double marketable = 0.1;
+    double depth = 10;
+    double sizeMean = 100;
+    double sizeSigma = 1.0;
+    int lot = 1;
+    double tick = 0.01;
+    double startPrice = 100;
+    bool count = true;
+    const char *out = nullptr;
+};
+
+// A passive order that AMEND and PULL can pick
+class LiveOrder
+{
+public:
+    int orderId;
+    int symbol;
+    bool buy;
+    int64_t price;
+    int volume;
+};
+
+// Output is collected in a buffer and written with fwrite, there is no iostream formatting per line
+class Output
+{
+public:
+    static const size_t BUFFER_SIZE = 1 << 20;
+
+    Output(FILE *file)
+    {
+        this->file = file;
+        buffer.resize(BUFFER_SIZE + 256);
+        used = 0;
+    }
+
+    ~Output()
+    {
+        flush();
+    }
+
+    void text(const char *s, size_t n)
+    {
+        memcpy(&buffer[used], s, n);
+        used += n;
+    }
+
+    void text(const string &s)
+    {
+        text(s.data(), s.size());
+    }
+
+    void number(int64_t value)
+    {
+        used = to_chars(&buffer[used], &buffer[used] + 24, value).ptr - buffer.data();
+    }
+
+    // A price in ticks, written with the decimals of the tick and without trailing zeros
+    void price(int64_t ticks, int64_t scale, int decimals)
+    {
+        number(ticks / scale);
+        int64_t fraction = ticks % scale;
+        if (fraction != 0)
+        {
+            char digits[24];
+            int length = decimals;
+            for (int i = decimals - 1; i >= 0; i--)
+            {
+                digits[i] = '0' + fraction % 10;
+                fraction /= 10;
+            }
+            while (digits[length - 1] == '0')
+            {
+                length--;
+            }
+            buffer[used++] = '.';
+            text(digits, length);
+        }
+    }
+
+    void endLine()
+    {
+        buffer[used++] = '\n';
+        if (used >= BUFFER_SIZE)
+        {
+            flush();
+        }
+    }
+
+    void flush()
+    {
+        fwrite(buffer.data(), 1, used, file);
+        used = 0;
+    }
+
+private:
+    FILE *file;
+    vector<char> buffer;
+    size_t used;
+};
+
+// Symbol names AAA, AAB, ... in the order of popularity, longer names when three letters are not enough
+string symbolName(int index)
+{
+    string name;
+    do
+    {
+        name += char('A' + index % 26);
+        index /= 26;
+    } while (index > 0);
+    while (name.size() < 3)
+    {
+        name += 'A';
+    }
+    reverse(name.begin(), name.end());
+    return name;
+}
+
+class Generator
+{
+public:
+    static const size_t POOL_SIZE = 1 << 20;
+    // The price queues of the pool are rebuilt when they hold this many times more entries than the pool
+    static const size_t QUEUE_SLACK = 4;
+    static const size_t SLOT_COUNT = 4 * POOL_SIZE;
+
+    Generator(const Options &options) : options(options), random(options.seed)
+    {
+        // Prices are integer ticks, the tick must have at most 8 decimals
+        decimals = 0;
+        scale = 1;
+        while (decimals < 8 && fabs(options.tick * scale - llround(options.tick * scale)) > 1e-9)
+        {
+            decimals++;
+            scale *= 10;
+        }
+        tickUnits = max<int64_t>(1, llround(options.tick * scale));
+
+        // Cumulative Zipf weights, a symbol is drawn with a binary search
+        double total = 0;
+        for (int rank = 1; rank <= options.symbols; rank++)
+        {
+            total += 1.0 / pow(rank, options.zipf);
+            popularity.push_back(total);
+        }
+        for (double &weight : popularity)
+        {
+            weight /= total;
+        }
+        for (int i = 0; i < options.symbols; i++)
+        {
+            names.push_back(symbolName(i));
+            mid.push_back(options.startPrice / options.tick);
+        }
+        slots.resize(SLOT_COUNT);
+        bids.resize(options.symbols);
+        asks.resize(options.symbols);
+        nextOrderId = 1;
+    }
+
+    void run(Output &out)
+    {
+        if (options.count)
+        {
+            out.number((int64_t)options.messages);
+            out.endLine();
+        }
+        for (uint64_t i = 0; i < options.messages; i++)
+        {
+            double draw = random.uniform();
+            if (draw < options.cancelRatio && !pool.empty())
+            {
+                pull(out);
+            }
+            else if (draw < options.cancelRatio + options.amendRatio && !pool.empty())
+            {
+                amend(out);
+            }
+            else
+            {
+                insert(out);
+            }
+            out.endLine();
+        }
+        out.flush();
+    }
+
+private:
+    const Options &options;
+    Random random;
+    int decimals;
+    int64_t scale;
+    int64_t tickUnits;
+    vector<double> popularity;
+    vector<string> names;
+    // The mid price of every symbol in ticks, it takes a normal step every time the symbol is drawn
+    vector<double> mid;
+    vector<LiveOrder> pool;
+    // The place in the pool by order id modulo SLOT_COUNT. The ids of the pool are recent, they seldom share a slot;
+    // an order that lost its slot is not found by its price queue entry, it stays in the pool.
+    vector<uint32_t> slots;
+    // The (price, order id) of the buy and sell orders of the pool by symbol, the highest bid and the lowest ask on top.
+    // An entry is stale when its order left the pool or moved to another price, it is skipped when it gets to the top.
+    vector<priority_queue<pair<int64_t, int>>> bids;
+    vector<priority_queue<pair<int64_t, int>, vector<pair<int64_t, int>>, greater<pair<int64_t, int>>>> asks;
+    size_t queued = 0;
+    int nextOrderId;
+
+    int drawSymbol()
+    {
+        int symbol = (int)(lower_bound(popularity.begin(), popularity.end(), random.uniform()) - popularity.begin());
+        return min(symbol, options.symbols - 1);
+    }
+
+    int drawVolume()
+    {
+        double size = options.sizeMean * exp(options.sizeSigma * random.normal());
+        int lots = max(1, (int)llround(size / options.lot));
+        return (int)min<int64_t>((int64_t)lots * options.lot, INT_MAX);
+    }
+
+    // Move the mid of the symbol and return it in whole ticks, never below one tick.
+    // The orders of the pool that the new mid reaches leave it.
+    int64_t stepMid(int symbol)
+    {
+        mid[symbol] = max(1.0 + options.depth * 4, mid[symbol] + options.volatility * random.normal());
+        int64_t midTicks = llround(mid[symbol]);
+        while (!bids[symbol].empty() && bids[symbol].top().first >= midTicks)
+        {
+            forget(bids[symbol].top());
+            bids[symbol].pop();
+            queued--;
+        }
+        while (!asks[symbol].empty() && asks[symbol].top().first <= midTicks)
+        {
+            forget(asks[symbol].top());
+            asks[symbol].pop();
+            queued--;
+        }
+        return midTicks;
+    }
+
+    // A passive price rests behind the mid, a marketable one is through it
+    int64_t drawPrice(int64_t midTicks, bool buy, bool marketable)
+    {
+        int64_t offset = marketable ? 1 + random.geometric(options.depth / 4) : 1 + random.geometric(options.depth);
+        int64_t ticks = buy == marketable ? midTicks + offset : midTicks - offset;
+        return max<int64_t>(1, ticks);
+    }
+
+    void writePrice(Output &out, int64_t ticks)
+    {
+        out.price(ticks * tickUnits, scale, decimals);
+    }
+
+    void insert(Output &out)
+    {
+        int symbol = drawSymbol();
+        int64_t midTicks = stepMid(symbol);
+        bool buy = random.uniform() < 0.5;
+        bool marketable = random.uniform() < options.marketable;
+        LiveOrder order{nextOrderId, symbol, buy, drawPrice(midTicks, buy, marketable), drawVolume()};
+        nextOrderId = nextOrderId == INT_MAX ? 1 : nextOrderId + 1;
+
+        out.text("INSERT,", 7);
+        out.number(order.orderId);
+        out.text(",", 1);
+        out.text(names[symbol]);
+        out.text(buy ? ",BUY," : ",SELL,", buy ? 5 : 6);
+        writePrice(out, order.price);
+        out.text(",", 1);
+        out.number(order.volume);
+        if (!marketable)
+        {
+            remember(order);
+        }
+    }
+
+    // A full pool forgets a random order
+    void remember(const LiveOrder &order)
+    {
+        if (pool.size() == POOL_SIZE)
+        {
+            removeFromPool(random.below(pool.size()));
+        }
+        slots[order.orderId % SLOT_COUNT] = (uint32_t)pool.size();
+        pool.push_back(order);
+        if (order.buy)
+        {
+            bids[order.symbol].emplace(order.price, order.orderId);
+        }
+        else
+        {
+            asks[order.symbol].emplace(order.price, order.orderId);
+        }
+        if (++queued > QUEUE_SLACK * POOL_SIZE)
+        {
+            rebuildQueues();
+        }
+    }
+
+    // Remove the order of a price queue entry from the pool, unless the entry is stale
+    void forget(const pair<int64_t, int> &entry)
+    {
+        uint32_t index = slots[entry.second % SLOT_COUNT];
+        if (index < pool.size() && pool[index].orderId == entry.second && pool[index].price == entry.first)
+        {
+            removeFromPool(index);
+        }
+    }
+
+    void removeFromPool(size_t index)
+    {
+        if (index + 1 != pool.size())
+        {
+            pool[index] = pool.back();
+            slots[pool[index].orderId % SLOT_COUNT] = (uint32_t)index;
+        }
+        pool.pop_back();
+    }
+
+    // Drop the stale entries of the price queues, so they do not grow with the number of commands
+    void rebuildQueues()
+    {
+        for (int symbol = 0; symbol < options.symbols; symbol++)
+        {
+            bids[symbol] = {};
+            asks[symbol] = {};
+        }
+        for (const LiveOrder &order : pool)
+        {
+            if (order.buy)
+            {
+                bids[order.symbol].emplace(order.price, order.orderId);
+            }
+            else
+            {
+                asks[order.symbol].emplace(order.price, order.orderId);
+            }
+        }
+        queued = pool.size();
+    }
+
+    // Take a random order out of the pool
+    LiveOrder takeFromPool()
+    {
+        size_t index = random.below(pool.size());
+        LiveOrder order = pool[index];
+        removeFromPool(index);
+        return order;
+    }
+
+    void pull(Output &out)
+    {
+        LiveOrder order = takeFromPool();
+        out.text("PULL,", 5);
+        out.number(order.orderId);
+    }
+
+    // Half of the amends only reduce the volume (the order keeps its priority), the others move the order to a new price
+    void amend(Output &out)
+    {
+        LiveOrder order = takeFromPool();
+        if (random.uniform() < 0.5 && order.volume > options.lot)
+        {
+            order.volume = max(options.lot, order.volume / 2 / options.lot * options.lot);
+        }
+        else
+        {
+            order.price = drawPrice(stepMid(order.symbol), order.buy, false);
+            order.volume = drawVolume();
+        }
+        out.text("AMEND,", 6);
+        out.number(order.orderId);
+        out.text(",", 1);
+        writePrice(out, order.price);
+        out.text(",", 1);
+        out.number(order.volume);
+        remember(order);
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (arg == "--no-count")
+        {
+            options.count = false;
+            continue;
+        }
+        if (value == nullptr)
+        {
+            cerr << "Missing value for " << arg << endl;
+            return 1;
+        }
+        i++;
+        if (arg == "--messages")
+        {
+            options.messages = stoull(value);
+        }
+        else if (arg == "--seed")
+        {
+            options.seed = stoull(value);
+        }
+        else if (arg == "--symbols")
+        {
+            options.symbols = max(1, stoi(value));
+        }
+        else if (arg == "--zipf")
+        {
+            options.zipf = stod(value);
+        }
+        else if (arg == "--cancel-ratio")
+        {
+            options.cancelRatio = stod(value);
+        }
+        else if (arg == "--amend-ratio")
+        {
+            options.amendRatio = stod(value);
+        }
+        else if (arg == "--volatility")
+        {
+            options.volatility = stod(value);
+        }
+        else if (arg == "--marketable")
+        {
+            options.marketable = stod(value);
+        }
+        else if (arg == "--depth")
+        {
+            options.depth = stod(value);
+        }
+        else if (arg == "--size-mean")
+        {
+            options.sizeMean = stod(value);
+        }
+        else if (arg == "--size-sigma")
+        {
+            options.sizeSigma = stod(value);
+        }
+        else if (arg == "--lot")
+        {
+            options.lot = max(1, stoi(value));
+        }
+        else if (arg == "--tick")
+        {
+            options.tick = stod(value);
+        }
+        else if (arg == "--start-price")
+        {
+            options.startPrice = stod(value);
+        }
+        else if (arg == "--out")
+        {
+            options.out = value;
+        }
+        else
+        {
+            cerr << "Unknown option " << arg << endl;
+            return 1;
+        }
+    }
+
+    FILE *file = stdout;
+    if (options.out != nullptr)
+    {
+        file = fopen(options.out, "wb");
+        if (file == nullptr)
+        {
+            cerr << "Can not open " << options.out << endl;
+            return 1;
+        }
+    }
+    {
+        Output out(file);
+        Generator generator(options);
+        generator.run(out);
+    }
+    if (file != stdout)
+    {
+        fclose(file);
+    }
+    return 0;
+}
@@ -7,20 +7,23 @@ The supported operations on orders are PULL, AMEND, and INSERT, which can be fur
 Upon execution, the order LimitBook generates sorted bid and ask price levels.
 
 The main approach of the implementation is as follows:
-A balanced binary tree is utilized to store price levels instead of individual orders, ensuring the prices are sorted in ascending order.
-Each price level is represented by a linked list of orders.
+Price levels are stored instead of individual orders. Each side of a book is a PriceLadder: a dense band of levels indexed
+by the integer tick price around the best price, with an outlier map for the prices outside the band.
+The band follows the best price as it drifts, so almost every level lookup is an array index.
+Each price level is represented by an intrusive linked list of orders.
 
 To elaborate further:
 
-An order ID to order mapping is maintained.
-A map called "limitLookUp" is used to map a combination of symbol, side (BUY/SELL), and price limit to a "Limit" object, 
-which represents a linked list of prices. Additional maps are employed to store prices sorted by sell and buy.
+An order ID to order mapping (OrderIndex) is maintained, it points straight at the node of the resting order.
+The order nodes of a book are allocated from the OrderPool of that book and are linked through handles (indices in the pool),
+so adding, filling and removing an order does not allocate memory.
+Every symbol is interned once into a dense id by the SymbolTable, the books are stored in a vector indexed by that id.
 
 Review of the implementaion: 
 This implementation is faster than having a balance tree with node as order that I implemented in the my pervious submission. 
-It helps deletion, insert faster, if the price level exists before, it can be O(1)
-One improvement, I can think of is to use arrays or circular buffers. This help to store data local and deletion lazy.
-(This help to reduce memory fragementation, cache Locality reduce overhead because arrays and circualr buffers store contiguously)
+Finding a level near the touch is O(1) in the dense band, and the next best level is found with the occupancy bits of the band
+instead of a tree walk. The levels and the orders are stored contiguously (the band and the OrderPool), which keeps them in
+cache and avoids memory fragmentation. Only the prices far from the touch are still in a tree (the outlier map).
 */
 
 #include <iostream>
@@ -31,46 +34,328 @@ One improvement, I can think of is to use arrays or circular buffers. This help
 #include <sstream>
 #include <cassert> 
 #include <map>
+#include <string_view>
+#include <charconv>
+#include <fcntl.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#ifdef _WIN32
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include <bits/stdc++.h>
 
 using namespace std;
 
+// Side of an order
+enum Side : uint8_t
+{
+    BUY,
+    SELL
+};
+
+// What happens to the volume of an incoming order that does not match right away
+// - GOOD_TILL_CANCEL: the remainder rests in the book (the plain limit order)
+// - IMMEDIATE_OR_CANCEL: the remainder is cancelled
+// - FILL_OR_KILL: the order is filled completely or not at all, nothing rests
+enum TimeInForce : uint8_t
+{
+    GOOD_TILL_CANCEL,
+    IMMEDIATE_OR_CANCEL,
+    FILL_OR_KILL
+};
+
+// A market order is an order with the most aggressive price there is, it crosses every level of the opposite side
+const int64_t MARKET_BUY_PRICE = INT64_MAX;
+const int64_t MARKET_SELL_PRICE = INT64_MIN;
+// The stop price of an order that is not a stop order
+const int64_t NO_STOP_PRICE = INT64_MIN;
+
+// What the matching loop does when an incoming order would trade with a resting order of the same owner (self-trade
+// prevention). The mode of the incoming order applies, there is never a trade between the two:
+// - CANCEL_NEWEST: the rest of the incoming order is cancelled
+// - CANCEL_OLDEST: the resting order is cancelled and the incoming order goes on matching
+// - CANCEL_BOTH: both are cancelled
+// - DECREMENT: the smaller of the two volumes is taken off both, an order that gets to 0 is done
+enum SelfTradePrevention : uint8_t
+{
+    CANCEL_NEWEST,
+    CANCEL_OLDEST,
+    CANCEL_BOTH,
+    DECREMENT
+};
+
+// The owner (participant id) of an order without one, such orders never count as a self-trade
+const int NO_OWNER = 0;
+// The owner the matching loop compares with when the incoming order has no owner, no resting order has it
+const int NEVER_OWNER = -1;
+
+//////////////////////////////////////////////////////////METRICS///////////////////////////////////////////////////////////////////////////
+// Compile with -DENGINE_METRICS to record the latency of every command and count the work of the matching loop (see EngineMetrics).
+// Without it ENGINE_METRIC(...) is empty, the engine has no timing code and no counters at all.
+#ifdef ENGINE_METRICS
+#define ENGINE_METRIC(...) __VA_ARGS__
+#else
+#define ENGINE_METRIC(...)
+#endif
+
+#ifdef ENGINE_METRICS
+// LatencyHistogram counts values in HDR style buckets: values below SUB_COUNT have their own bucket, above that every power
+// of two is split into SUB_COUNT linear buckets. A percentile is off by at most 1/SUB_COUNT (3%), whatever the range.
+// The buckets are a fixed array, recording a value is a clz, a shift and an increment.
+class LatencyHistogram
+{
+public:
+    static const int SUB_BITS = 5;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+    static const int BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+    void record(uint64_t value)
+    {
+        counts[bucketOf(value)]++;
+        total++;
+        largest = max(largest, value);
+    }
+
+    void merge(const LatencyHistogram &other)
+    {
+        for (int i = 0; i < BUCKETS; i++)
+        {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        largest = max(largest, other.largest);
+    }
+
+    uint64_t count() const
+    {
+        return total;
+    }
+
+    uint64_t maximum() const
+    {
+        return largest;
+    }
+
+    // The highest value of the bucket that holds the value of rank p (0 < p <= 1)
+    uint64_t percentile(double p) const
+    {
+        uint64_t rank = (uint64_t)ceil(p * total);
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++)
+        {
+            seen += counts[i];
+            if (seen >= rank && seen != 0)
+            {
+                return min(largest, bucketTop(i));
+            }
+        }
+        return largest;
+    }
+
+private:
+    uint64_t counts[BUCKETS] = {};
+    uint64_t total = 0;
+    uint64_t largest = 0;
+
+    static int bucketOf(uint64_t value)
+    {
+        if (value < SUB_COUNT)
+        {
+            return (int)value;
+        }
+        int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        return (shift + 1) * SUB_COUNT + (int)((value >> shift) - SUB_COUNT);
+    }
+
+    static uint64_t bucketTop(int bucket)
+    {
+        if (bucket < SUB_COUNT)
+        {
+            return bucket;
+        }
+        int shift = bucket / SUB_COUNT - 1;
+        uint64_t next = (uint64_t)(bucket % SUB_COUNT + SUB_COUNT + 1) << shift;
+        return next - 1;
+    }
+};
+
+// The kinds of command that get their own latency histogram. An INSERT that trades is much slower than one that rests.
+enum MetricCommand : uint8_t {INSERT_MATCHED_METRIC, INSERT_RESTING_METRIC, AMEND_METRIC, PULL_METRIC, METRIC_COMMANDS};
+
+// EngineMetrics holds the histograms and counters of one thread, so the hot path never shares a cache line with another
+// thread. local() gives the metrics of the calling thread, they stay registered after the thread ends and dumpAll() merges them.
+// - latency: steady_clock time of processCommand per MetricCommand, in ns
+// - fillsPerOrder: the number of fills of every command that traded
+// - fills, levelsSwept: the fills and the price levels emptied by the matching loop
+// - levelsCreated, outlierLevelsCreated: price levels opened in the dense ladder and in the outlier map (a map node allocation)
+// - ladderRebases: the times a PriceLadder moved its band onto the best price
+// - poolGrowths: allocations of an order node that had to grow the OrderPool
+class EngineMetrics
+{
+public:
+    LatencyHistogram latency[METRIC_COMMANDS];
+    LatencyHistogram fillsPerOrder;
+    uint64_t fills = 0;
+    uint64_t levelsSwept = 0;
+    uint64_t levelsCreated = 0;
+    uint64_t outlierLevelsCreated = 0;
+    uint64_t ladderRebases = 0;
+    uint64_t poolGrowths = 0;
+
+    static EngineMetrics &local()
+    {
+        thread_local EngineMetrics *metrics = nullptr;
+        if (metrics == nullptr)
+        {
+            lock_guard<mutex> guard(registryLock());
+            registry().emplace_back(new EngineMetrics());
+            metrics = registry().back().get();
+        }
+        return *metrics;
+    }
+
+    // Merge the metrics of every thread and print them. The other threads may still be recording (after a signal),
+    // then the numbers are a close approximation.
+    static void dumpAll(ostream &out)
+    {
+        EngineMetrics total;
+        {
+            lock_guard<mutex> guard(registryLock());
+            for (const unique_ptr<EngineMetrics> &metrics : registry())
+            {
+                total.merge(*metrics);
+            }
+        }
+        total.dump(out);
+    }
+
+    void merge(const EngineMetrics &other)
+    {
+        for (int i = 0; i < METRIC_COMMANDS; i++)
+        {
+            latency[i].merge(other.latency[i]);
+        }
+        fillsPerOrder.merge(other.fillsPerOrder);
+        fills += other.fills;
+        levelsSwept += other.levelsSwept;
+        levelsCreated += other.levelsCreated;
+        outlierLevelsCreated += other.outlierLevelsCreated;
+        ladderRebases += other.ladderRebases;
+        poolGrowths += other.poolGrowths;
+    }
+
+    void dump(ostream &out) const
+    {
+        static const char *names[METRIC_COMMANDS] = {"INSERT matched", "INSERT resting", "AMEND", "PULL"};
+        out << "command            count      p50 ns      p99 ns    p99.9 ns      max ns" << '\n';
+        for (int i = 0; i < METRIC_COMMANDS; i++)
+        {
+            writeRow(out, names[i], latency[i]);
+        }
+        writeRow(out, "fills per order", fillsPerOrder);
+        out << "fills " << fills << ", levels swept " << levelsSwept << ", levels created " << levelsCreated
+            << " (outliers " << outlierLevelsCreated << "), ladder rebases " << ladderRebases << ", order pool growths " << poolGrowths << endl;
+    }
+
+private:
+    static mutex &registryLock()
+    {
+        static mutex lock;
+        return lock;
+    }
+
+    static vector<unique_ptr<EngineMetrics>> &registry()
+    {
+        static vector<unique_ptr<EngineMetrics>> metrics;
+        return metrics;
+    }
+
+    static void writeRow(ostream &out, const char *name, const LatencyHistogram &histogram)
+    {
+        char row[128];
+        snprintf(row, sizeof(row), "%-15s %8llu %11llu %11llu %11llu %11llu\n", name, (unsigned long long)histogram.count(),
+                 (unsigned long long)histogram.percentile(0.5), (unsigned long long)histogram.percentile(0.99),
+                 (unsigned long long)histogram.percentile(0.999), (unsigned long long)histogram.maximum());
+        out << row;
+    }
+};
+
+// Set by SIGUSR1, the next command that finishes dumps the metrics to stderr
+volatile sig_atomic_t metricsDumpRequested = 0;
+
+// Record the latency of one command that started at started. fills is the number of fills it made.
+inline void recordCommandMetrics(EngineMetrics &metrics, MetricCommand kind, uint64_t fills, chrono::steady_clock::time_point started)
+{
+    uint64_t elapsed = (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count();
+    metrics.latency[kind].record(elapsed);
+    if (fills != 0)
+    {
+        metrics.fillsPerOrder.record(fills);
+    }
+    if (metricsDumpRequested)
+    {
+        metricsDumpRequested = 0;
+        EngineMetrics::dumpAll(cerr);
+    }
+}
+#endif
+
 // Stock order Order.
 //  It contains
+//  - price of the stock in integer ticks
 //  - orderID,
-//  - symbol: Symbol of the stocks
-//  - side: string of either buy or sell
-//  - price of the stock
 //  - volume of the stock
-//  - timestamp: the time when the order was created (Note the timestamp variable is the variable I created when I add to the stock)
-//  - nextOrder: pointer to the next order in the linked list
-//  - prevOrder: pointer to the previous order in the linked list
+//  - timestamp: the sequence number of the command that created the order or of its last amend that lost the priority (the time priority of a waiting stop)
+//  - owner: the participant id for the self-trade prevention, NO_OWNER if there is none
+//  - displayVolume: the clip an iceberg order shows, 0 when the whole volume is shown
+//  - side: BUY or SELL
+//  - timeInForce: whether the remainder rests, is cancelled, or the order is killed if it can not be filled completely
+//  - selfTradePrevention: what happens when it meets a resting order of the same owner
+// The members are ordered from the largest to the smallest and the two small enums share a byte, so the record is packed
+// into 32 bytes and is trivially copyable. It has no symbol: an order is always handled together with its LimitBook.
+// Two orders fit in one cache line and the matching loop does not compare any string.
 class StockOrder
 {
 public:
+    int64_t price;
     int orderId;
-    string symbol;
-    string side;
-    float price;
     int volume;
     int timestamp;
+    int owner;
+    int displayVolume;
+    Side side;
+    TimeInForce timeInForce : 4;
+    SelfTradePrevention selfTradePrevention : 4;
 
-    StockOrder(int orderId, string symbol, string side, float price, int volume, int timestamp)
+    StockOrder(int orderId, Side side, int64_t price, int volume, int timestamp, TimeInForce timeInForce = GOOD_TILL_CANCEL,
+               int displayVolume = 0, int owner = NO_OWNER, SelfTradePrevention selfTradePrevention = CANCEL_NEWEST)
     {
         this->orderId = orderId;
-        this->symbol = symbol;
         this->side = side;
         this->price = price;
         this->volume = volume;
         this->timestamp = timestamp;
+        this->timeInForce = timeInForce;
+        this->displayVolume = displayVolume;
+        this->owner = owner;
+        this->selfTradePrevention = selfTradePrevention;
     }
     StockOrder() {}
 };
+static_assert(sizeof(StockOrder) <= 32, "StockOrder should stay within half a cache line");
+static_assert(is_trivially_copyable<StockOrder>::value, "StockOrder should be a POD record");
 
 // MatchedOrders is a class that represents the result of matching two orders.
 // It contains the following member variables:
-// - symbol: the symbol of the matched stock
-// - price: the price at which the orders were matched
+// - symbolId: the interned id of the symbol of the matched stock
+// - price: the price (in ticks) at which the orders were matched
 // - volume: the volume of the matched orders
 // - aggressive_order_id: the identifier of the aggressive order (the order that initiated the match)
 // - passive_order_id: the identifier of the passive order (the order that was matched against)
@@ -80,15 +365,15 @@ public:
 class MatchedOrders
 {
 public:
-    string symbol;
-    float price;
+    uint32_t symbolId;
+    int64_t price;
     int volume;
     int agressiveOrderId;
     int passiveOrderId;
 
-    MatchedOrders(string symbol, float price, int volume, int agressiveOrderId, int passiveOrderId)
+    MatchedOrders(uint32_t symbolId, int64_t price, int volume, int agressiveOrderId, int passiveOrderId)
     {
-        this->symbol = symbol;
+        this->symbolId = symbolId;
         this->price = price;
         this->volume = volume;
         this->agressiveOrderId = agressiveOrderId;
@@ -97,385 +382,4038 @@ public:
     MatchedOrders() {}
 };
 
+// Handle of an order node inside an OrderPool. NULL_ORDER marks the end of a list or an empty level.
+const uint32_t NULL_ORDER = UINT32_MAX;
+// The handle in the OrderLocation of a stop order that waits for its trigger, it has no node yet (see LimitBook::buyStops)
+const uint32_t STOP_ORDER = UINT32_MAX - 1;
+
+// OrderNode is a resting order inside a LimitBook. It is allocated from the OrderPool of the book and linked into
+// the queue of its price level through prevOrder / nextOrder, so there is no separate heap node per order.
+// The symbol is implied by the book that holds the node.
+// - price: the price of the order in ticks
+// - orderId: the identifier of the order
+// - volume: the remaining volume of the order
+// - prevOrder: handle of the previous (older) order at the same level
+// - nextOrder: handle of the next (newer) order at the same level
+// - side: the side of the order, it tells which side of the book holds the level
+// - owner: the participant id of the order, NO_OWNER if there is none. The matching loop compares it on every fill.
+// - iceberg: the order has a hidden reserve in LimitBook::reserves, volume is only its displayed clip
+// - selfTradePrevention: the mode of the order, it is kept for an amend that matches the order again
+class OrderNode
+{
+public:
+    int64_t price;
+    int orderId;
+    int volume;
+    uint32_t prevOrder;
+    uint32_t nextOrder;
+    int owner;
+    Side side;
+    bool iceberg;
+    SelfTradePrevention selfTradePrevention;
+};
+static_assert(sizeof(OrderNode) <= 32, "OrderNode should stay within half a cache line");
+
+// OrderPool is the slab that owns all order nodes of one book.
+// Nodes are addressed by their index (a handle), which stays valid until the node is released even when the slab grows.
+// Released nodes are chained in a free list and reused first, so once the pool is warm insert/fill/cancel do not call malloc.
+class OrderPool
+{
+public:
+    vector<OrderNode> nodes;
+    uint32_t freeHead = NULL_ORDER;
+
+    OrderNode &operator[](uint32_t handle)
+    {
+        return nodes[handle];
+    }
+
+    uint32_t allocate()
+    {
+        if (freeHead != NULL_ORDER)
+        {
+            uint32_t handle = freeHead;
+            freeHead = nodes[handle].nextOrder;
+            return handle;
+        }
+        ENGINE_METRIC(if (nodes.size() == nodes.capacity()) EngineMetrics::local().poolGrowths++;)
+        nodes.emplace_back();
+        return (uint32_t)(nodes.size() - 1);
+    }
+
+    void release(uint32_t handle)
+    {
+        nodes[handle].nextOrder = freeHead;
+        freeHead = handle;
+    }
+};
+
 // Limit is a class representing a price level in a trading system. It contains a linked list of orders.
-// - limitPrice: the price level of the limit
+// - limitPrice: the price level of the limit in ticks
 // - totalVolume: the total volume (quantity) of orders at this price level
-// - side: the side of the limit (BUY or SELL)
+// - hiddenVolume: the volume the icebergs of the level hold in reserve, it is not part of totalVolume
 // - size: the number of orders in the linked list
-// - headOrder: the head (first) order in the linked list
-// - tailOrder: the tail (last) order in the linked list
+// - headOrder: the head (first, oldest) order in the linked list, this is the next order to be matched
+// - tailOrder: the tail (last, newest) order in the linked list
 class Limit
 {
 public:
-    float limitPrice;
+    int64_t limitPrice;
     int totalVolume;
-    string side;
+    int hiddenVolume;
     int size;
-    list<StockOrder> listStock;
+    uint32_t headOrder;
+    uint32_t tailOrder;
 
-    Limit(float limitPrice, string side, int totalVolume)
+    Limit(int64_t limitPrice)
     {
         this->limitPrice = limitPrice; 
         this->totalVolume = 0; //Initially, the total volum is 0 
+        this->hiddenVolume = 0;
         this->size = 0; //We maintain size. This is helpful when print out the left stock that previously unmatched
+        this->headOrder = NULL_ORDER;
+        this->tailOrder = NULL_ORDER;
     }
 
     Limit() {}
 };
 
 
-class LimitBook {
-public:
-    map<float, Limit, greater<float>> buyTree;
-    map<float, Limit> sellTree; 
-
-    LimitBook() {}
-};
-
-
-/////////////////////////////////////////////////HELPER FUNCTION////////////////////////////////////////////////////////
-
-
-// Convert a float to the string
-// Input: float x
-// Output: return string
-string convertFloatToString(float x)
-{
-    stringstream s;
-    s << x;
-    string finalResult = s.str();
-    return finalResult;
-}
+// Number of ticks on each side of the best price that PriceLadder stores in its dense array.
+// Compile with -DLADDER_BAND_TICKS=0 to turn the ladder off and keep every level in the sparse map (the old tree mode).
+#ifndef LADDER_BAND_TICKS
+#define LADDER_BAND_TICKS 512
+#endif
 
-//  Convert a string to string ot a float
-//  Input: float x
-//  Output: string
-float convertToFloat(const string &priceString)
+// PriceLadder stores the price levels of one side of a LimitBook.
+// - levels: a dense array indexed by (price - basePrice) / tick covering 2 * bandTicks + 1 ticks around the best price
+// - tick: the greatest common divisor of the prices seen on the side, so a book quoted in cents uses one slot per cent
+// - occupied: one bit per slot of levels, used to skip empty ticks when searching the next best level
+// - bestIndex: cached index of the best level in the dense array, so best() does not search anything
+// - outliers: a sparse map (the old tree) for the prices outside the band
+// Better is the ordering of the side: greater<int64_t> for the buy side, less<int64_t> for the sell side.
+// Most of the activity is a few hundred ticks around the touch, so almost every lookup is an array index instead of a tree walk.
+// The band follows the touch: when the best price gets too close to either end of the band (or the map holds the best price),
+// the band is moved back around the best price and the levels move between the array and the map (see followBest).
+// A move costs O(band / 64 + levels moved) and happens at most once every bandTicks / 4 ticks of drift.
+// A price between two ticks refines the tick and rebuilds the band the same way, which only happens a few times per book.
+template <class Better>
+class PriceLadder
 {
-    size_t dotPos = priceString.find('.');
-    if (dotPos == string::npos)
+public:
+    PriceLadder(int64_t bandTicks = LADDER_BAND_TICKS)
     {
-        // No decimal point found, assuming whole number
-        return stof(priceString);
+        this->bandTicks = bandTicks;
+        this->basePrice = 0;
+        this->tick = MAX_TICK;
+        this->span = 0;
+        this->bestIndex = -1;
+        this->denseCount = 0;
     }
 
-    size_t digitsAfterDot = priceString.length() - dotPos - 1;
-    if (digitsAfterDot > 4)
+    bool empty() const
     {
-        // More than 4 digits after the decimal point
-        cout << "String input error, more than 4 number behind the decimal";
+        return denseCount == 0 && outliers.empty();
     }
 
-    return stof(priceString);
-}
-
-// Input: String s
-// Output: splits the input string s into multiple substring based on a delimiter as "," 
-vector<string> splitString(string s)
-{
-    for (int i = 0; i < s.size(); ++i)
+    // Number of price levels on this side
+    size_t size() const
     {
-        if (s[i] == ',')
-            s[i] = ' ';
+        return denseCount + outliers.size();
     }
-    istringstream is(s);
-    vector<string> finalResult;
-    string x;
-    while (is >> x)
-        finalResult.push_back(x);
-    return finalResult;
-}
-
-// The function matches an order (the curOrder is not added to the orderbook yet) from the input with the corresponding order in the opposite tree.
-// It retrieves the best price from the opposite tree using limitSetSellLookUp or limitSetBuyLookUp.
-// Once the price is obtained, it performs a limit lookup to find potential matches and evaluates whether they can be matched or not. 
-// If a match is found, a trade is executed; otherwise, curOrder is not added to the limitbook if its volume is zero.
-void matchOrder(StockOrder *curOrder, vector<string> &finalResult, unordered_map<int, StockOrder> &orderLookUp, unordered_map<string, LimitBook>& bookLookUp, set<string> &allSymbols)
-{
-    int orderId = curOrder->orderId;
-    string symbol = curOrder->symbol;
-    string side = curOrder->side;
-    float price = curOrder->price;
-    int volume = curOrder->volume;
-    int timestamp = curOrder->timestamp;
-
-    // Match the current order with the order from the opposite side
-    string keyLimitLookUp = symbol + side + convertFloatToString(price);
-    string oppositeSide = (side == "BUY") ? "SELL" : "BUY";
-    //vecMatchedOrders is a vector to store all the matched orderd. This is in the format that helps to print out. 
-    vector<MatchedOrders> vecMatchedOrders;
 
-    while (true)
+    // Return the best level (highest buy or lowest sell), or nullptr if the side is empty
+    Limit *best()
     {
-        // If the opposite tree does not have any order then we break
-        if ((side == "BUY" && bookLookUp[symbol].sellTree.size() == 0) || (side == "SELL" && bookLookUp[symbol].buyTree.size() == 0))
+        Limit *denseBest = denseCount != 0 ? &levels[bestIndex] : nullptr;
+        if (outliers.empty())
         {
-            break;
+            return denseBest;
         }
-        Limit *potentialMatchLimit; 
-        if (side == "BUY") {
-            potentialMatchLimit = &bookLookUp[symbol].sellTree.begin()->second;
-        } else {
-            potentialMatchLimit = &bookLookUp[symbol].buyTree.begin()->second;
-        } 
-        
-        // //Get the pontential match order
-        StockOrder *potentialMatchOrder = &potentialMatchLimit->listStock.back(); 
-
-        // If this is a match which the current side is sell and the price of sell is smaller or equal to the biggest buy price in the buy tree
-        if (curOrder->side == "SELL" && potentialMatchOrder->price >= curOrder->price)
+        Limit *sparseBest = &outliers.begin()->second;
+        if (denseBest == nullptr || Better()(sparseBest->limitPrice, denseBest->limitPrice))
         {
-            int tmp = min(potentialMatchOrder->volume, curOrder->volume);
-            //update the volume of the curOrder
-            curOrder->volume -= tmp;
-            //Update the volume of the potentialMatchOrder (Matched in this case)
-            potentialMatchOrder->volume -= tmp;
-            //Update the limit. (This will helps to keep track of number of volume at that price)
-            potentialMatchLimit->totalVolume -= tmp;
-            //Put into the matches object, this will help with the printing
-            MatchedOrders matches(symbol, potentialMatchOrder->price, tmp, curOrder->orderId, potentialMatchOrder->orderId);
-            vecMatchedOrders.push_back(matches);
+            return sparseBest;
         }
-        //If this is a match which the current side is buy and teh price of buy is bigger or equal to the smallest price in the sell tree
-        else if (curOrder->side == "BUY" && potentialMatchOrder->price <= curOrder->price)
+        return denseBest;
+    }
+
+    // Return the level at price, or nullptr if there is no order at that price
+    Limit *find(int64_t price)
+    {
+        int64_t index = slotOf(price);
+        if (index >= 0)
         {
-            int tmp = min(potentialMatchOrder->volume, curOrder->volume);
-            //update the volume of the curOrder
-            curOrder->volume -= tmp;
-            //Update the volume of the potentialMatchOrder (Matched in this case)
-            potentialMatchOrder->volume -= tmp;
-            //Update the limit. (This will helps to keep track of number of volume at that price)
-            potentialMatchLimit->totalVolume -= tmp;
-            //Put into the matches object, this will help with the printing
-            MatchedOrders matches(symbol, potentialMatchOrder->price, tmp, curOrder->orderId, potentialMatchOrder->orderId);
-            vecMatchedOrders.push_back(matches);
+            return isOccupied(index) ? &levels[index] : nullptr;
         }
-        else
+        auto it = outliers.find(price);
+        return it != outliers.end() ? &it->second : nullptr;
+    }
+
+    // Return the level at price, creating an empty one if it does not exist yet
+    Limit &insert(int64_t price)
+    {
+        int64_t index = slotOf(price);
+        if (index < 0 && bandTicks > 0 && (levels.empty() || price % tick != 0))
         {
-            // There is no match anymore, so break; 
-            break;
+            // First level of the side, or a price between two ticks of the band
+            tick = gcd(tick, price);
+            rebase(empty() ? price : best()->limitPrice);
+            index = slotOf(price);
         }
-        if (potentialMatchOrder->volume == 0)
+        if (index < 0)
         {
-            // Hand in the remove all in here
-            potentialMatchLimit->listStock.pop_back();
+            auto inserted = outliers.emplace(price, Limit(price));
+            if (!inserted.second || !followBest())
+            {
+                ENGINE_METRIC(if (inserted.second) EngineMetrics::local().outlierLevelsCreated++;)
+                return inserted.first->second;
+            }
+            // The new level is the best one, the band moved onto it
+            ENGINE_METRIC(EngineMetrics::local().levelsCreated++;)
+            return *find(price);
         }
-
-        // There is a match, so now we need to remove it from the order from the order LimitBook, because the volume of it is 0
-        if (curOrder->volume == 0)
+        if (!isOccupied(index))
         {
-            break;
+            placeDense(index, Limit(price));
+            ENGINE_METRIC(EngineMetrics::local().levelsCreated++;)
+            if (index == bestIndex && followBest())
+            {
+                return *find(price);
+            }
         }
+        return levels[index];
     }
 
-    //If the curOrer is not equal 0 then we add it to the order LimitBook. 
-    if (curOrder->volume != 0)
+    // Remove the level at price. The level is expected to be empty.
+    void erase(int64_t price)
     {
-        Limit *potentialMatchLimit; 
-        // Do I need to limit look up here. I think yes right, because I need to find the limit of the think or havign the order match the limit? 
-        if (side == "BUY") {
-            potentialMatchLimit = &bookLookUp[symbol].sellTree.begin()->second;
-        } else {
-            potentialMatchLimit = &bookLookUp[symbol].buyTree.begin()->second;
-        } 
-            cout << "efew" <<endl;
-        potentialMatchLimit->listStock.push_front(*curOrder); 
-
+        int64_t index = slotOf(price);
+        if (index < 0)
+        {
+            outliers.erase(price);
+            return;
+        }
+        if (!isOccupied(index))
+        {
+            return;
+        }
+        occupied[index >> 6] &= ~(uint64_t(1) << (index & 63));
+        denseCount--;
+        if (index == bestIndex)
+        {
+            bestIndex = denseCount != 0 ? nextWorseIndex(index) : -1;
+            followBest();
+        }
     }
 
-    // push the match to the result
-    for (MatchedOrders &matchedOrders : vecMatchedOrders)
+    // Return the level after the given one in priority order (the next lower buy or next higher sell), or nullptr at the end.
+    // Together with best() this walks the side from the best price to the worst one.
+    Limit *next(const Limit *level)
     {
-        finalResult.push_back(matchedOrders.symbol + "," + convertFloatToString(matchedOrders.price) + "," + to_string(matchedOrders.volume) 
-        + "," + to_string(matchedOrders.agressiveOrderId) + "," + to_string(matchedOrders.passiveOrderId));
+        int64_t price = level->limitPrice;
+        Limit *denseNext = nullptr;
+        if (denseCount != 0)
+        {
+            int64_t index = slotOf(price);
+            if (index >= 0)
+            {
+                index = nextWorseIndex(index);
+                denseNext = index >= 0 ? &levels[index] : nullptr;
+            }
+            else if (Better()(price, levels[bestIndex].limitPrice))
+            {
+                denseNext = &levels[bestIndex];
+            }
+        }
+        if (outliers.empty())
+        {
+            return denseNext;
+        }
+        auto it = outliers.upper_bound(price);
+        if (it == outliers.end())
+        {
+            return denseNext;
+        }
+        if (denseNext == nullptr || Better()(it->first, denseNext->limitPrice))
+        {
+            return &it->second;
+        }
+        return denseNext;
     }
-    return;
-}
 
+private:
+    static constexpr bool higherIsBetter = Better()(1, 0);
 
+    // Largest tick the ladder starts with, 100 units of price (PRICE_DECIMALS = 4), every usual tick size divides it
+    static constexpr int64_t MAX_TICK = 1000000;
 
-//////////////////////////////////////////////////////////QUERY FUNCTION ///////////////////////////////////////////////////////////////////////////
+    int64_t bandTicks;
+    int64_t basePrice;
+    int64_t tick;
+    // Price range covered by the band, levels.size() * tick
+    uint64_t span;
+    int64_t bestIndex;
+    size_t denseCount;
+    vector<Limit> levels;
+    vector<uint64_t> occupied;
+    map<int64_t, Limit, Better> outliers;
+    // The levels of the array while the band moves
+    vector<Limit> moving;
+
+    // Index of price in the dense array, or -1 if price is outside the band or between two ticks
+    int64_t slotOf(int64_t price) const
+    {
+        uint64_t offset = uint64_t(price) - uint64_t(basePrice);
+        if (offset >= span || offset % tick != 0)
+        {
+            return -1;
+        }
+        return offset / tick;
+    }
 
+    bool isOccupied(int64_t index) const
+    {
+        return (occupied[index >> 6] >> (index & 63)) & 1;
+    }
 
-// Process Insert query 
-// The function create curOrbject and call matchOrder to find if possible trade can happen
-void processInsertQuery(vector<string> command, vector<string> &finalResult, unordered_map<int, StockOrder> &orderLookUp, unordered_map<string, LimitBook>& bookLookUp, set<string> &allSymbols)
-{
-    int orderId = stoi(command[1]);
-    string symbol = command[2];
-    string side = command[3];
-    float price = convertToFloat(command[4]);
-    int volume = stoi(command[5]);
-    int timestamp = stoi(command[6]);
+    bool isBetterIndex(int64_t a, int64_t b) const
+    {
+        return higherIsBetter ? a > b : a < b;
+    }
 
-    StockOrder curOrder(orderId, symbol, side, price, volume, timestamp);
-    //Check if we can match the order. (For the match order, in this case, 
-    //in code will add the current order if after the match the volume is greater than 0)
-    matchOrder(&curOrder, finalResult, orderLookUp, bookLookUp, allSymbols);
-    return;
-}
+    // The base price of a band with the best price at price: half a band of room for better prices, one and a half behind it
+    int64_t baseFor(int64_t price) const
+    {
+        return max<int64_t>(price - (higherIsBetter ? 2 * bandTicks - bandTicks / 2 : bandTicks / 2) * tick, 0);
+    }
 
-//Process amend query
-//A pull removes the order from the order LimitBook. An amend changes the price and/or volume of the order. 
-//An amend causes the order to lose time priority in the order LimitBook, unless the only change to the 
-//orders that the volume is decreased. If the price of the order is amended, it needs to be re-evaluated for potential matches.
-// void processAmendQuery(vector<string> command, vector<string> &finalResult, unordered_map<int, StockOrder> &orderLookUp, unordered_map<string, Limit> &limitLookUp, 
-// unordered_map<string, set<float>> &limitSetSellLookUp, unordered_map<string, set<float, greater<float>>> &limitSetBuyLookUp, set<string> &allSymbols)
-// {
-//     int orderId = stoi(command[1]);
-//     float priceChange = convertToFloat(command[2]);
-//     int volumeChange = stoi(command[3]);
-//     int timestamp = stoi(command[4]);
-//     StockOrder curOrder;
-//     assert(volumeChange != 0);
-//     //If we can not find order
-//     if (orderLookUp.find(orderId) != orderLookUp.end())
-//     {
-//         curOrder = orderLookUp[orderId];
-//     }
-//     else
-//     {
-//         cout << "Invalid amend request";
-//     }
-
-//     //If amend does not change the volume and price, then nothing will chante return
-//     if (curOrder.volume == volumeChange && curOrder.price == priceChange)
-//     {
-//         return;
-//     }
-
-//     // If the volume decrease, and the price does not change. The priority of the order will remain the same, so 
-//     if (curOrder.volume > volumeChange && curOrder.price == priceChange)
-//     {
-//         orderLookUp[orderId].volume = volumeChange;
-//         limitLookUp[curOrder.symbol + curOrder.side + convertFloatToString(curOrder.price)].totalVolume -= (curOrder.volume - volumeChange);
-//         return;
-//     }
-
-//     // The amend incrase the volume or changes the price, so remove the order from the order LimitBook
-//     removeOrder(&curOrder, finalResult, orderLookUp, limitLookUp, limitSetSellLookUp, limitSetBuyLookUp, allSymbols);
-//     //Update the order
-//     curOrder.volume = volumeChange;
-//     curOrder.price = priceChange;
-//     //Match the order 
-//     matchOrder(&curOrder, finalResult, orderLookUp, limitLookUp, limitSetSellLookUp, limitSetBuyLookUp, allSymbols);
-//     return;
-// }
+    // Put level into the free slot index of the dense array
+    void placeDense(int64_t index, const Limit &level)
+    {
+        levels[index] = level;
+        occupied[index >> 6] |= uint64_t(1) << (index & 63);
+        if (denseCount == 0 || isBetterIndex(index, bestIndex))
+        {
+            bestIndex = index;
+        }
+        denseCount++;
+    }
 
-// Pull query 
-// The query will remove the order from the order LimitBook 
-// The function will call the remove function
-// void processPullQuery(vector<string> command, vector<string> &finalResult, unordered_map<int, StockOrder> &orderLookUp, unordered_map<string, Limit> 
-// &limitLookUp, unordered_map<string, set<float>>& limitSetSellLookUp, unordered_map<string, set<float, greater<float>>>& limitSetBuyLookUp, set<string>& allSymbols)
-// {
-//     int orderId = stoi(command[1]);
-//     if (orderLookUp.find(orderId) != orderLookUp.end())
-//     {
-//         StockOrder curOrder = orderLookUp[orderId];
-//         removeOrder(&curOrder, finalResult, orderLookUp, limitLookUp, limitSetSellLookUp, limitSetBuyLookUp, allSymbols);
-//     }
-//     else
-//     {
-//         cout << "Invalid pull request";
-//     }
-// }
+    // Move the band around the best price if the best price is in the map or less than bandTicks / 4 ticks from
+    // either end of the band.
+    // Return true if the band moved, the levels are then at other addresses.
+    bool followBest()
+    {
+        if (bandTicks == 0 || empty())
+        {
+            return false;
+        }
+        int64_t bestPrice = best()->limitPrice;
+        int64_t index = slotOf(bestPrice);
+        // Free ticks in front of the best price
+        int64_t ahead = higherIsBetter ? (int64_t)levels.size() - 1 - index : index;
+        if (index >= 0 && ahead >= bandTicks / 4 && ahead <= bandTicks)
+        {
+            return false;
+        }
+        if (baseFor(bestPrice) == basePrice)
+        {
+            // The best price is near 0, the band can not be centred on it
+            return false;
+        }
+        rebase(bestPrice);
+        return true;
+    }
 
-//The function get summary of bests matches of stocks sorted by symbols and print the remaining stock. 
-void outPutPerSymbol(vector<string> &finalResult, unordered_map<string, LimitBook>& bookLookUp, set<string>& allSymbols)
-{
-    //Loop through all the symbols 
-    for (const string &symbol : allSymbols)
-    { 
-        //If there exists stock of the symbol 
-        if (!bookLookUp[symbol].buyTree.empty() || !bookLookUp[symbol].sellTree.empty())
+    // Move the dense array around price (see baseFor). The levels of the array that fall outside the new band go to the map,
+    // the levels of the map that fall inside it go to the array. Only the range of the map inside the new band is visited.
+    void rebase(int64_t price)
+    {
+        ENGINE_METRIC(EngineMetrics::local().ladderRebases++;)
+        if (levels.empty())
         {
-            finalResult.push_back("===" + symbol + "===");
-        }  
-        //Iterator of the both of the set. 
-        auto it1 = bookLookUp[symbol].buyTree.begin();
-        auto it2 = bookLookUp[symbol].sellTree.begin();
-        while (it1 != bookLookUp[symbol].buyTree.end() || it2 != bookLookUp[symbol].sellTree.end())
+            levels.resize(2 * bandTicks + 1);
+            occupied.assign((levels.size() + 63) / 64, 0);
+        }
+        span = levels.size() * tick;
+        moving.clear();
+        for (size_t word = 0; word < occupied.size() && denseCount != 0; word++)
         {
-            //If there are orders on both side, then make the paris
-            if (it1 != bookLookUp[symbol].buyTree.end() && it2 != bookLookUp[symbol].sellTree.end())
+            for (uint64_t bits = occupied[word]; bits != 0; bits &= bits - 1)
             {
-                finalResult.push_back(convertFloatToString(it1->second.limitPrice) + "," + to_string(it1->second.totalVolume) + "," 
-                + convertFloatToString(it2->second.limitPrice) + "," + to_string(it2->second.totalVolume));
-                it1++;
-                it2++;
+                moving.push_back(levels[(word << 6) + __builtin_ctzll(bits)]);
             }
-            //If the buy side has order stocks
-            else if (it1 != bookLookUp[symbol].buyTree.end())
+            occupied[word] = 0;
+        }
+        denseCount = 0;
+        bestIndex = -1;
+        basePrice = baseFor(price);
+        for (const Limit &level : moving)
+        {
+            int64_t index = slotOf(level.limitPrice);
+            if (index >= 0)
             {
-                finalResult.push_back(convertFloatToString(it1->second.limitPrice) + "," + to_string(it1->second.totalVolume) + ",,");
-                it1++;
+                placeDense(index, level);
             }
-            //If the left side has order stocks 
             else
             {
-                finalResult.push_back(",," + convertFloatToString(it2->second.limitPrice) + "," + to_string(it2->second.totalVolume));
-                it2++;
+                outliers.emplace(level.limitPrice, level);
             }
         }
+        // The map is ordered from the best price, the range starts at the better end of the band
+        int64_t low = basePrice;
+        int64_t high = basePrice + (int64_t)span - tick;
+        auto first = outliers.lower_bound(higherIsBetter ? high : low);
+        auto last = outliers.upper_bound(higherIsBetter ? low : high);
+        for (auto it = first; it != last; it++)
+        {
+            placeDense(slotOf(it->first), it->second);
+        }
+        outliers.erase(first, last);
     }
-}
-
-//Input vector<string> of commands 
-//We loop through each command and find the matching functions with that commands. 
-//At the end 
-vector<string> run(vector<string> const &input)
-{
-    //Final result vector
-    vector<string> finalResult;
 
-    // This is the map from order id to stock order
-    unordered_map<int, StockOrder> orderLookUp;
-
-    // This is the map from symbol to LimitBook. 
-    unordered_map<string, LimitBook> bookLookUp;
-
-    //Set of all symbol 
-    set<string> allSymbols;
-    
-    //Loop through the input
-    for (int i = 0; i < input.size(); i++)
+    // Index of the next occupied slot after index in priority order, or -1 if there is none
+    int64_t nextWorseIndex(int64_t index) const
     {
-        vector<string> command = splitString(input[i]);
-        // Add the timestamp;
-        command.push_back(to_string(i));
-        if (command[0] == "INSERT")
+        if (higherIsBetter)
         {
-            processInsertQuery(command, finalResult, orderLookUp, bookLookUp, allSymbols);
+            // Highest occupied slot below index
+            int64_t word = (index - 1) >> 6;
+            if (index <= 0)
+            {
+                return -1;
+            }
+            uint64_t bits = occupied[word] & (~uint64_t(0) >> (63 - ((index - 1) & 63)));
+            while (true)
+            {
+                if (bits != 0)
+                {
+                    return (word << 6) + 63 - __builtin_clzll(bits);
+                }
+                if (word == 0)
+                {
+                    return -1;
+                }
+                bits = occupied[--word];
+            }
         }
-        else if (command[0] == "AMEND")
+        else
         {
-            // processAmendQuery(command, finalResult, orderLookUp, bookLookUp, allSymbols);
+            // Lowest occupied slot above index
+            int64_t start = index + 1;
+            if (start >= (int64_t)levels.size())
+            {
+                return -1;
+            }
+            int64_t word = start >> 6;
+            uint64_t bits = occupied[word] & (~uint64_t(0) << (start & 63));
+            while (true)
+            {
+                if (bits != 0)
+                {
+                    return (word << 6) + __builtin_ctzll(bits);
+                }
+                if (++word == (int64_t)occupied.size())
+                {
+                    return -1;
+                }
+                bits = occupied[word];
+            }
         }
-        else if (command[0] == "PULL")
-        {
-            // processPullQuery(command, finalResult, orderLookUp, bookLookUp, allSymbols);
+    }
+};
+
+// Both sides are keyed on the integer tick price, so two orders with the same price always land on the same level.
+// The sides are PriceLadders. With a band of 0 ticks they behave like the previous map<int64_t, Limit> trees.
+// The orders of the book live in its own OrderPool, the levels only keep the head and tail handle of their queue.
+// BookLevel is a copy of one price level for the market data: the answer of the depth queries and an L2 update.
+// In an L2 update a volume of 0 means the level is gone.
+class BookLevel
+{
+public:
+    uint32_t symbolId;
+    Side side;
+    int64_t price;
+    int volume;
+    int orders;
+};
+
+// StopKey is the place of a waiting stop order in LimitBook::buyStops or LimitBook::sellStops
+class StopKey
+{
+public:
+    Side side;
+    pair<int64_t, int> key;
+};
+
+// IcebergReserve is the hidden part of an iceberg order: the size of its clip and the volume that is not shown yet
+class IcebergReserve
+{
+public:
+    int displayVolume;
+    int hiddenVolume;
+};
+
+// OwnerCounts counts the resting orders of every owner on each side of a book. It is a flat open addressing table like
+// OrderIndex, but an owner keeps its slot when its counts get back to 0, so resting and releasing an order of a known
+// owner never inserts or erases an entry. The table only grows (doubling, when half full) with the distinct owners.
+class OwnerCounts
+{
+public:
+    OwnerCounts()
+    {
+        count = 0;
+    }
+
+    void add(Side side, int owner, int orders)
+    {
+        if (2 * (count + 1) > slots.size())
+        {
+            grow();
+        }
+        size_t mask = slots.size() - 1;
+        size_t i = hashOf(owner) & mask;
+        while (slots[i].owner != NO_OWNER && slots[i].owner != owner)
+        {
+            i = (i + 1) & mask;
+        }
+        if (slots[i].owner == NO_OWNER)
+        {
+            slots[i].owner = owner;
+            count++;
+        }
+        slots[i].orders[side] += orders;
+    }
+
+    // The number of resting orders of owner on side
+    int orders(Side side, int owner) const
+    {
+        if (slots.empty())
+        {
+            return 0;
+        }
+        size_t mask = slots.size() - 1;
+        for (size_t i = hashOf(owner) & mask; slots[i].owner != NO_OWNER; i = (i + 1) & mask)
+        {
+            if (slots[i].owner == owner)
+            {
+                return slots[i].orders[side];
+            }
+        }
+        return 0;
+    }
+
+private:
+    struct Slot
+    {
+        int owner = NO_OWNER;
+        int orders[2] = {0, 0};
+    };
+    vector<Slot> slots;
+    size_t count;
+
+    static size_t hashOf(int owner)
+    {
+        return (size_t)(((uint64_t)(uint32_t)owner * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+
+    void grow()
+    {
+        vector<Slot> old;
+        old.swap(slots);
+        slots.resize(max<size_t>(16, old.size() * 2));
+        size_t mask = slots.size() - 1;
+        for (const Slot &slot : old)
+        {
+            if (slot.owner != NO_OWNER)
+            {
+                size_t i = hashOf(slot.owner) & mask;
+                while (slots[i].owner != NO_OWNER)
+                {
+                    i = (i + 1) & mask;
+                }
+                slots[i] = slot;
+            }
+        }
+    }
+};
+
+class LimitBook {
+public:
+    uint32_t symbolId;
+    PriceLadder<greater<int64_t>> buyTree;
+    PriceLadder<less<int64_t>> sellTree; 
+    OrderPool orders;
+    // The best level of each side (volume 0 when the side is empty), refreshed after every command by refreshTop(),
+    // so polling the touch is a copy and does not look at the ladders. Like depth(), it is not synchronized: read it on the
+    // thread that processes the commands, between two commands. Another thread would need the engine to publish a copy.
+    BookLevel topBid = {};
+    BookLevel topAsk = {};
+    // The levels changed by the current command, only recorded when trackLevels is set (see publishLevelChanges)
+    bool trackLevels = false;
+    vector<pair<Side, int64_t>> changedLevels;
+    // The reserves of the iceberg orders of the book, indexed by the handle of their node like the OrderPool. Only the nodes
+    // with the iceberg flag have a valid entry, the array is allocated by the first iceberg of the book.
+    vector<IcebergReserve> reserves;
+    // The stop orders that wait for their trigger, as the order they become. Both maps are ordered by (key, timestamp), the key
+    // of a buy stop is its stop price and the key of a sell stop is minus its stop price. So begin() is the next stop to fire
+    // on either side and the stops of one price fire in time order.
+    map<pair<int64_t, int>, StockOrder> buyStops;
+    map<pair<int64_t, int>, StockOrder> sellStops;
+    // The place of every waiting stop by its order id, for PULL and AMEND
+    unordered_map<int, StopKey> stopKeys;
+    // The number of resting orders of every owner on each side, so a FOK order with an owner only walks the queues when the
+    // other side holds orders of its owner (see fillableVolume). Orders without an owner are not counted.
+    OwnerCounts owners;
+
+    LimitBook(int64_t ladderBandTicks = LADDER_BAND_TICKS) : buyTree(ladderBandTicks), sellTree(ladderBandTicks) {}
+
+    // Append the order to the back of the queue of the level (it gets the lowest time priority)
+    void appendOrder(Limit &limit, uint32_t handle)
+    {
+        OrderNode &node = orders[handle];
+        node.prevOrder = limit.tailOrder;
+        node.nextOrder = NULL_ORDER;
+        if (limit.tailOrder != NULL_ORDER)
+        {
+            orders[limit.tailOrder].nextOrder = handle;
+        }
+        else
+        {
+            limit.headOrder = handle;
+        }
+        limit.tailOrder = handle;
+        limit.totalVolume += node.volume;
+        limit.hiddenVolume += node.iceberg ? reserves[handle].hiddenVolume : 0;
+        limit.size++;
+        markChanged(node.side, limit.limitPrice);
+    }
+
+    // Unlink the order from the queue of the level in O(1). The node itself is not released.
+    void unlinkOrder(Limit &limit, uint32_t handle)
+    {
+        OrderNode &node = orders[handle];
+        if (node.prevOrder != NULL_ORDER)
+        {
+            orders[node.prevOrder].nextOrder = node.nextOrder;
+        }
+        else
+        {
+            limit.headOrder = node.nextOrder;
+        }
+        if (node.nextOrder != NULL_ORDER)
+        {
+            orders[node.nextOrder].prevOrder = node.prevOrder;
+        }
+        else
+        {
+            limit.tailOrder = node.prevOrder;
+        }
+        limit.totalVolume -= node.volume;
+        limit.hiddenVolume -= node.iceberg ? reserves[handle].hiddenVolume : 0;
+        limit.size--;
+        markChanged(node.side, limit.limitPrice);
+    }
+
+    void markChanged(Side side, int64_t price)
+    {
+        if (trackLevels)
+        {
+            changedLevels.emplace_back(side, price);
+        }
+    }
+
+    // Return the level that holds the resting order. The level is found from the price of the node,
+    // which is a direct index into the ladder for every price inside the band.
+    Limit *levelOf(uint32_t handle)
+    {
+        OrderNode &node = orders[handle];
+        return node.side == BUY ? buyTree.find(node.price) : sellTree.find(node.price);
+    }
+
+    // Remove a resting order from the book in O(1): unlink it from its level, drop the level if it is empty
+    // and give the node back to the pool. The orders queued at the same level are never searched.
+    void removeOrder(uint32_t handle)
+    {
+        OrderNode &node = orders[handle];
+        Limit *limit = levelOf(handle);
+        unlinkOrder(*limit, handle);
+        if (limit->size == 0)
+        {
+            if (node.side == BUY) {
+                buyTree.erase(node.price);
+            } else {
+                sellTree.erase(node.price);
+            }
+        }
+        releaseOrder(handle);
+    }
+
+    // Give the node of an unlinked order back to the pool, the entry of its reserve is reused with the node
+    void releaseOrder(uint32_t handle)
+    {
+        OrderNode &node = orders[handle];
+        if (node.owner != NO_OWNER)
+        {
+            owners.add(node.side, node.owner, -1);
+        }
+        orders.release(handle);
+    }
+
+    // Count a new resting order of owner
+    void addOwnerOrder(Side side, int owner)
+    {
+        if (owner != NO_OWNER)
+        {
+            owners.add(side, owner, 1);
+        }
+    }
+
+    // The number of resting orders of owner on side
+    int ownerOrders(Side side, int owner) const
+    {
+        return owners.orders(side, owner);
+    }
+
+    // Make the order an iceberg that shows displayVolume at a time, hiddenVolume is not in the book yet.
+    // The order is not in its level yet, appendOrder adds the reserve to the hiddenVolume of the level.
+    void setReserve(uint32_t handle, int displayVolume, int hiddenVolume)
+    {
+        if (handle >= reserves.size())
+        {
+            reserves.resize(orders.nodes.size());
+        }
+        reserves[handle] = IcebergReserve{displayVolume, hiddenVolume};
+        orders[handle].iceberg = true;
+    }
+
+    // The displayed clip of an iceberg is filled: show the next clip from the reserve and move the order to the back
+    // of the queue of its level, it is the same node so this is O(1) and the order keeps its handle.
+    // Return false if the reserve is used up, then the order is done.
+    bool replenish(Limit &limit, uint32_t handle)
+    {
+        IcebergReserve &reserve = reserves[handle];
+        if (reserve.hiddenVolume == 0)
+        {
+            return false;
+        }
+        unlinkOrder(limit, handle);
+        int clip = min(reserve.displayVolume, reserve.hiddenVolume);
+        reserve.hiddenVolume -= clip;
+        orders[handle].volume = clip;
+        appendOrder(limit, handle);
+        return true;
+    }
+
+    // Park the order until a trade reaches stopPrice: at or above it for a buy, at or below it for a sell
+    void addStop(const StockOrder &order, int64_t stopPrice)
+    {
+        StopKey stop{order.side, make_pair(order.side == BUY ? stopPrice : -stopPrice, order.timestamp)};
+        (order.side == BUY ? buyStops : sellStops).emplace(stop.key, order);
+        stopKeys[order.orderId] = stop;
+    }
+
+    // Return the waiting stop order, or nullptr
+    StockOrder *findStop(int orderId)
+    {
+        auto it = stopKeys.find(orderId);
+        if (it == stopKeys.end())
+        {
+            return nullptr;
+        }
+        map<pair<int64_t, int>, StockOrder> &stops = it->second.side == BUY ? buyStops : sellStops;
+        return &stops.find(it->second.key)->second;
+    }
+
+    // Give the waiting stop a new timestamp, it goes behind the stops of its stop price that are waiting already
+    void requeueStop(int orderId, int timestamp)
+    {
+        StopKey &stop = stopKeys.find(orderId)->second;
+        map<pair<int64_t, int>, StockOrder> &stops = stop.side == BUY ? buyStops : sellStops;
+        auto entry = stops.extract(stop.key);
+        entry.key().second = timestamp;
+        entry.mapped().timestamp = timestamp;
+        stop.key = entry.key();
+        stops.insert(move(entry));
+    }
+
+    void removeStop(int orderId)
+    {
+        auto it = stopKeys.find(orderId);
+        if (it != stopKeys.end())
+        {
+            (it->second.side == BUY ? buyStops : sellStops).erase(it->second.key);
+            stopKeys.erase(it);
+        }
+    }
+
+    // Move the stops that trades between low and high trigger to triggered, in the order they fire: the buy stops at or
+    // below high from the lowest stop price, then the sell stops at or above low from the highest one.
+    // Only the triggered stops are looked at.
+    void takeTriggeredStops(int64_t low, int64_t high, vector<StockOrder> &triggered)
+    {
+        while (!buyStops.empty() && buyStops.begin()->first.first <= high)
+        {
+            triggered.push_back(buyStops.begin()->second);
+            stopKeys.erase(buyStops.begin()->second.orderId);
+            buyStops.erase(buyStops.begin());
+        }
+        while (!sellStops.empty() && -sellStops.begin()->first.first >= low)
+        {
+            triggered.push_back(sellStops.begin()->second);
+            stopKeys.erase(sellStops.begin()->second.orderId);
+            sellStops.erase(sellStops.begin());
+        }
+    }
+
+    // Add an order at the back of the queue of its price level, the level is created if needed. Return the handle of the node.
+    // With a displayVolume the order is an iceberg with hiddenVolume in reserve.
+    uint32_t restOrder(Side side, int64_t price, int orderId, int volume, int owner = NO_OWNER, SelfTradePrevention selfTradePrevention = CANCEL_NEWEST,
+                       int displayVolume = 0, int hiddenVolume = 0)
+    {
+        Limit &limit = side == BUY ? buyTree.insert(price) : sellTree.insert(price);
+        uint32_t handle = orders.allocate();
+        OrderNode &node = orders[handle];
+        node.price = price;
+        node.orderId = orderId;
+        node.volume = volume;
+        node.side = side;
+        node.iceberg = false;
+        node.owner = owner;
+        node.selfTradePrevention = selfTradePrevention;
+        addOwnerOrder(side, owner);
+        if (displayVolume != 0)
+        {
+            setReserve(handle, displayVolume, hiddenVolume);
+        }
+        appendOrder(limit, handle);
+        return handle;
+    }
+
+    // Copy the level into a BookLevel, nullptr gives an empty level at price 0
+    BookLevel view(Side side, const Limit *limit) const
+    {
+        if (limit == nullptr)
+        {
+            return BookLevel{symbolId, side, 0, 0, 0};
+        }
+        return BookLevel{symbolId, side, limit->limitPrice, limit->totalVolume, limit->size};
+    }
+
+    void refreshTop()
+    {
+        topBid = view(BUY, buyTree.best());
+        topAsk = view(SELL, sellTree.best());
+    }
+
+    // Copy the best n levels of one side into levels, from the best price to the worst one.
+    // This walks the occupied levels only, the cost is O(n) and not O(levels of the side).
+    // Call it on the thread that processes the commands, between two commands: the ladders are not locked.
+    void depth(Side side, size_t n, vector<BookLevel> &levels)
+    {
+        levels.clear();
+        if (side == BUY)
+        {
+            for (Limit *level = buyTree.best(); level != nullptr && levels.size() < n; level = buyTree.next(level))
+            {
+                levels.push_back(view(BUY, level));
+            }
+        }
+        else
+        {
+            for (Limit *level = sellTree.best(); level != nullptr && levels.size() < n; level = sellTree.next(level))
+            {
+                levels.push_back(view(SELL, level));
+            }
+        }
+    }
+};
+
+// OrderLocation is where a resting order lives: the id of the book that holds it and its handle in the pool of that book.
+// A stop order that waits for its trigger has the handle STOP_ORDER.
+class OrderLocation
+{
+public:
+    uint32_t symbolId;
+    uint32_t handle;
+};
+
+// SymbolTable interns every symbol once into a dense id (0, 1, 2, ...) in the order the symbols are first seen.
+// The books are stored in a vector indexed by that id, so after the first lookup of a command
+// the engine never hashes or copies the symbol string again.
+// - names: the symbol strings, a deque so the string_view keys of ids stay valid when it grows
+// - ids: map from symbol to its id
+class SymbolTable
+{
+public:
+    // Return the id of the symbol, a new id is assigned the first time the symbol is seen
+    uint32_t intern(string_view symbol)
+    {
+        auto it = ids.find(symbol);
+        if (it != ids.end())
+        {
+            return it->second;
+        }
+        uint32_t symbolId = (uint32_t)names.size();
+        names.emplace_back(symbol);
+        ids.emplace(string_view(names.back()), symbolId);
+        return symbolId;
+    }
+
+    // Look the symbol up without adding it, return false if it was never seen
+    bool find(string_view symbol, uint32_t &symbolId) const
+    {
+        auto it = ids.find(symbol);
+        if (it == ids.end())
+        {
+            return false;
+        }
+        symbolId = it->second;
+        return true;
+    }
+
+    const string &name(uint32_t symbolId) const
+    {
+        return names[symbolId];
+    }
+
+    size_t size() const
+    {
+        return names.size();
+    }
+
+    // All symbol ids sorted alphabetically by symbol, this is the order of the end of day output
+    vector<uint32_t> sortedIds() const
+    {
+        vector<uint32_t> sorted(names.size());
+        for (uint32_t i = 0; i < sorted.size(); i++)
+        {
+            sorted[i] = i;
+        }
+        sort(sorted.begin(), sorted.end(), [this](uint32_t a, uint32_t b) { return names[a] < names[b]; });
+        return sorted;
+    }
+
+private:
+    deque<string> names;
+    unordered_map<string_view, uint32_t> ids;
+};
+
+// OrderIndex maps an order ID to the OrderLocation of the resting order.
+// It is an open addressing hash table with linear probing stored in one flat array. Erase shifts the following
+// entries back instead of leaving tombstones, so lookups stay short. Unlike unordered_map it does not allocate
+// a node per insert, the array only grows (doubling) when it is half full.
+class OrderIndex
+{
+public:
+    // When erasedLog is set, the id of every erased order is appended to it (see ShardWorker::departed)
+    vector<int> *erasedLog = nullptr;
+
+    OrderIndex()
+    {
+        slots.resize(1024);
+        count = 0;
+    }
+
+    // Return the location of the order, or nullptr if the order is not resting in any book
+    OrderLocation *find(int orderId)
+    {
+        size_t mask = slots.size() - 1;
+        for (size_t i = hashOf(orderId) & mask; slots[i].used; i = (i + 1) & mask)
+        {
+            if (slots[i].orderId == orderId)
+            {
+                return &slots[i].location;
+            }
+        }
+        return nullptr;
+    }
+
+    // Insert or overwrite the location of the order
+    void insert(int orderId, OrderLocation location)
+    {
+        if (2 * (count + 1) > slots.size())
+        {
+            grow();
+        }
+        size_t mask = slots.size() - 1;
+        size_t i = hashOf(orderId) & mask;
+        while (slots[i].used && slots[i].orderId != orderId)
+        {
+            i = (i + 1) & mask;
+        }
+        if (!slots[i].used)
+        {
+            count++;
+        }
+        slots[i].used = true;
+        slots[i].orderId = orderId;
+        slots[i].location = location;
+    }
+
+    void erase(int orderId)
+    {
+        size_t mask = slots.size() - 1;
+        size_t i = hashOf(orderId) & mask;
+        while (slots[i].used && slots[i].orderId != orderId)
+        {
+            i = (i + 1) & mask;
+        }
+        if (!slots[i].used)
+        {
+            return;
+        }
+        if (erasedLog != nullptr)
+        {
+            erasedLog->push_back(orderId);
+        }
+        // Backward shift: move every following entry of the probe run that may sit in the hole
+        size_t hole = i;
+        for (size_t j = (i + 1) & mask; slots[j].used; j = (j + 1) & mask)
+        {
+            size_t home = hashOf(slots[j].orderId) & mask;
+            if (((j - home) & mask) >= ((j - hole) & mask))
+            {
+                slots[hole] = slots[j];
+                hole = j;
+            }
+        }
+        slots[hole].used = false;
+        count--;
+    }
+
+private:
+    struct Slot
+    {
+        bool used = false;
+        int orderId = 0;
+        OrderLocation location;
+    };
+    vector<Slot> slots;
+    size_t count;
+
+    static size_t hashOf(int orderId)
+    {
+        // Fibonacci hashing, the top bits are well mixed even for consecutive IDs
+        return (size_t)(((uint64_t)(uint32_t)orderId * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+
+    void grow()
+    {
+        vector<Slot> old;
+        old.swap(slots);
+        slots.resize(old.size() * 2);
+        count = 0;
+        for (const Slot &slot : old)
+        {
+            if (slot.used)
+            {
+                insert(slot.orderId, slot.location);
+            }
+        }
+    }
+};
+
+
+/////////////////////////////////////////////////HELPER FUNCTION////////////////////////////////////////////////////////
+
+// Prices are kept as fixed-point integer ticks: price * 10^4 stored in an int64_t.
+// The input has at most 4 digits behind the decimal, so every valid price is exactly representable,
+// and comparing or hashing a price is a plain integer operation.
+const int PRICE_DECIMALS = 4;
+const int64_t TICKS_PER_UNIT = 10000;
+// The largest price in ticks the parser accepts. It stays far from the market order prices at the ends of int64_t,
+// so adding a band of ticks to a price can not overflow.
+const int64_t MAX_PRICE_TICKS = INT64_MAX / 4;
+
+// Write a tick price as the decimal string at out, trailing zeros behind the decimal are dropped (122000 is "12.2")
+// Input: the output buffer (at least 24 chars) and the price in ticks
+// Output: pointer past the last written char
+char *writeTicks(char *out, int64_t ticks)
+{
+    if (ticks < 0)
+    {
+        *out++ = '-';
+        ticks = -ticks;
+    }
+    out = to_chars(out, out + 20, ticks / TICKS_PER_UNIT).ptr;
+    int64_t fraction = ticks % TICKS_PER_UNIT;
+    if (fraction != 0)
+    {
+        char digits[PRICE_DECIMALS];
+        int length = PRICE_DECIMALS;
+        for (int i = PRICE_DECIMALS - 1; i >= 0; i--)
+        {
+            digits[i] = char('0' + fraction % 10);
+            fraction /= 10;
+        }
+        while (digits[length - 1] == '0')
+            length--;
+        *out++ = '.';
+        memcpy(out, digits, length);
+        out += length;
+    }
+    return out;
+}
+
+/////////////////////////////////////////////////COMMAND PARSER////////////////////////////////////////////////////////
+
+enum CommandType : uint8_t
+{
+    INVALID_COMMAND,
+    INSERT_COMMAND,
+    AMEND_COMMAND,
+    PULL_COMMAND
+};
+
+// Longest symbol the parser accepts
+const int MAX_SYMBOL_LENGTH = 15;
+
+// Command is one decoded input line. It is a fixed-size POD, the symbol is copied into the struct
+// so a command does not point into the line it was parsed from.
+// - type: INSERT, AMEND or PULL
+// - side: the side of an INSERT
+// - timeInForce: the time in force of an INSERT
+// - symbol / symbolLength: the symbol of an INSERT
+// - orderId: the order the command refers to
+// - price: the price in ticks (INSERT and AMEND)
+// - volume: the volume (INSERT and AMEND)
+// - displayVolume: the clip of an iceberg INSERT, 0 for an order that shows its whole volume
+// - stopPrice: the trigger price of a stop INSERT, NO_STOP_PRICE for an order that goes to the book right away
+// - owner / selfTradePrevention: the participant id of an INSERT (NO_OWNER if it has none) and its self-trade prevention mode
+// - timestamp: the sequence number of the command in the input, it is set by the caller
+// - symbolId: the interned id of the symbol of an INSERT, it is set by whoever interns the symbol
+struct Command
+{
+    CommandType type;
+    Side side;
+    TimeInForce timeInForce;
+    uint8_t symbolLength;
+    char symbol[MAX_SYMBOL_LENGTH + 1];
+    int orderId;
+    int volume;
+    int displayVolume;
+    int64_t price;
+    int timestamp;
+    uint32_t symbolId;
+    int64_t stopPrice;
+    int owner;
+    SelfTradePrevention selfTradePrevention;
+
+    string_view symbolView() const
+    {
+        return string_view(symbol, symbolLength);
+    }
+};
+
+// Read the field under the cursor up to the next comma (or the end of the line) and move the cursor past the comma
+string_view readField(const char *&cursor, const char *end)
+{
+    const char *start = cursor;
+    while (cursor != end && *cursor != ',')
+        cursor++;
+    string_view field(start, cursor - start);
+    if (cursor != end)
+        cursor++;
+    return field;
+}
+
+// Read an integer field with from_chars, the field must end at a comma or at the end of the line
+bool readInt(const char *&cursor, const char *end, int &value)
+{
+    from_chars_result result = from_chars(cursor, end, value);
+    if (result.ec != errc() || (result.ptr != end && *result.ptr != ','))
+        return false;
+    cursor = result.ptr == end ? end : result.ptr + 1;
+    return true;
+}
+
+// Read a decimal price field straight into integer ticks without going through a float ("12.2" is 122000)
+// More than 4 digits behind the decimal is reported, the extra digits are truncated.
+// A price is positive: a negative price, a price of 0 or a price above MAX_PRICE_TICKS is reported and not read.
+bool readTicks(const char *&cursor, const char *end, int64_t &ticks)
+{
+    if (cursor != end && *cursor == '-')
+    {
+        cerr << "String input error, the price is not positive" << endl;
+        return false;
+    }
+    int64_t units = 0;
+    const char *digits = cursor;
+    while (cursor != end && (unsigned)(*cursor - '0') < 10)
+    {
+        units = units * 10 + (*cursor - '0');
+        if (units > MAX_PRICE_TICKS / TICKS_PER_UNIT)
+        {
+            cerr << "String input error, the price is out of range" << endl;
+            return false;
+        }
+        cursor++;
+    }
+    bool hasDigits = cursor != digits;
+    int64_t fraction = 0;
+    int digitsAfterDot = 0;
+    if (cursor != end && *cursor == '.')
+    {
+        cursor++;
+        while (cursor != end && (unsigned)(*cursor - '0') < 10)
+        {
+            if (digitsAfterDot < PRICE_DECIMALS)
+            {
+                fraction = fraction * 10 + (*cursor - '0');
+            }
+            digitsAfterDot++;
+            cursor++;
+        }
+        hasDigits = hasDigits || digitsAfterDot != 0;
+    }
+    if (!hasDigits || (cursor != end && *cursor != ','))
+        return false;
+    if (cursor != end)
+        cursor++;
+    if (digitsAfterDot > PRICE_DECIMALS)
+    {
+        // More than 4 digits after the decimal point
+        cerr << "String input error, more than 4 number behind the decimal" << endl;
+    }
+    for (int d = min(digitsAfterDot, PRICE_DECIMALS); d < PRICE_DECIMALS; d++)
+    {
+        fraction *= 10;
+    }
+    ticks = units * TICKS_PER_UNIT + fraction;
+    if (ticks == 0)
+    {
+        cerr << "String input error, the price is not positive" << endl;
+        return false;
+    }
+    return true;
+}
+
+// Decode one input line in a single pass over its bytes, without allocating:
+//   INSERT,<order id>,<symbol>,<BUY|SELL>,<price|MARKET>,<volume>[,<GTC|IOC|FOK>][,DISPLAY=<clip>][,STOP=<price>]
+//          [,OWNER=<participant id>][,STP=<NEWEST|OLDEST|BOTH|DECREMENT>]
+//   AMEND,<order id>,<price>,<volume>
+//   PULL,<order id>
+// Input: the line
+// The optional fields of an INSERT can come in any order, without a time in force it is GTC.
+// With STOP the order waits until a trade reaches the stop price, MARKET with STOP is a stop market order.
+// The participant id of OWNER is a positive number, the STP mode is NEWEST when it is not given. A MARKET order never rests, it is IOC unless it is FOK.
+// The volume and the prices (limit and stop) of an INSERT or an AMEND are positive, see readTicks for the prices. A symbol has at most MAX_SYMBOL_LENGTH chars, a longer one is reported.
+// Output: true and the decoded command, or false if the line is not a valid command
+bool parseCommand(string_view line, Command &command)
+{
+    const char *cursor = line.data();
+    const char *end = cursor + line.size();
+    // Tolerate Windows line endings and trailing spaces
+    while (end != cursor && (end[-1] == '\r' || end[-1] == ' '))
+        end--;
+    command.type = INVALID_COMMAND;
+    command.side = BUY;
+    command.timeInForce = GOOD_TILL_CANCEL;
+    command.symbolLength = 0;
+    command.symbol[0] = '\0';
+    command.price = 0;
+    command.volume = 0;
+    command.displayVolume = 0;
+    command.stopPrice = NO_STOP_PRICE;
+    command.owner = NO_OWNER;
+    command.selfTradePrevention = CANCEL_NEWEST;
+
+    string_view keyword = readField(cursor, end);
+    if (keyword == "INSERT")
+    {
+        if (!readInt(cursor, end, command.orderId))
+            return false;
+        string_view symbol = readField(cursor, end);
+        if (symbol.size() > MAX_SYMBOL_LENGTH)
+        {
+            cerr << "String input error, the symbol is longer than " << MAX_SYMBOL_LENGTH << " chars" << endl;
+            return false;
+        }
+        if (symbol.empty())
+            return false;
+        memcpy(command.symbol, symbol.data(), symbol.size());
+        command.symbol[symbol.size()] = '\0';
+        command.symbolLength = (uint8_t)symbol.size();
+        string_view side = readField(cursor, end);
+        if (side == "BUY")
+            command.side = BUY;
+        else if (side == "SELL")
+            command.side = SELL;
+        else
+            return false;
+        bool market = end - cursor >= 6 && string_view(cursor, 6) == "MARKET" && (end - cursor == 6 || cursor[6] == ',');
+        if (market)
+        {
+            cursor += end - cursor == 6 ? 6 : 7;
+            command.price = command.side == BUY ? MARKET_BUY_PRICE : MARKET_SELL_PRICE;
+        }
+        else if (!readTicks(cursor, end, command.price))
+            return false;
+        if (!readInt(cursor, end, command.volume) || command.volume <= 0)
+            return false;
+        while (cursor != end)
+        {
+            string_view option = readField(cursor, end);
+            if (option == "IOC")
+                command.timeInForce = IMMEDIATE_OR_CANCEL;
+            else if (option == "FOK")
+                command.timeInForce = FILL_OR_KILL;
+            else if (option.substr(0, 8) == "DISPLAY=")
+            {
+                const char *value = option.data() + 8;
+                if (!readInt(value, option.data() + option.size(), command.displayVolume) || command.displayVolume <= 0)
+                    return false;
+            }
+            else if (option.substr(0, 5) == "STOP=")
+            {
+                const char *value = option.data() + 5;
+                if (!readTicks(value, option.data() + option.size(), command.stopPrice))
+                    return false;
+            }
+            else if (option.substr(0, 6) == "OWNER=")
+            {
+                const char *value = option.data() + 6;
+                if (!readInt(value, option.data() + option.size(), command.owner) || command.owner <= 0)
+                    return false;
+            }
+            else if (option == "STP=NEWEST")
+                command.selfTradePrevention = CANCEL_NEWEST;
+            else if (option == "STP=OLDEST")
+                command.selfTradePrevention = CANCEL_OLDEST;
+            else if (option == "STP=BOTH")
+                command.selfTradePrevention = CANCEL_BOTH;
+            else if (option == "STP=DECREMENT")
+                command.selfTradePrevention = DECREMENT;
+            else if (option != "GTC")
+                return false;
+        }
+        if (market && command.timeInForce == GOOD_TILL_CANCEL)
+            command.timeInForce = IMMEDIATE_OR_CANCEL;
+        command.type = INSERT_COMMAND;
+    }
+    else if (keyword == "AMEND")
+    {
+        if (!readInt(cursor, end, command.orderId) || !readTicks(cursor, end, command.price) || !readInt(cursor, end, command.volume) ||
+            command.volume <= 0)
+            return false;
+        command.type = AMEND_COMMAND;
+    }
+    else if (keyword == "PULL")
+    {
+        if (!readInt(cursor, end, command.orderId))
+            return false;
+        command.type = PULL_COMMAND;
+    }
+    return command.type != INVALID_COMMAND;
+}
+
+/////////////////////////////////////////////////OUTPUT////////////////////////////////////////////////////////
+
+// EventSink receives everything the engine outputs, in order:
+// - onSymbol: a symbol got its id, before the first event that uses the id
+// - onTrade: one fill, the price is the price of the passive order
+// - onBookHeader / onDepthRow: the end of day depth of one symbol, one row pairs the i-th best bid with the i-th best ask
+//   (bid or ask is nullptr when that side has no more levels)
+// - flush: the engine is done, buffered output has to be written
+class EventSink
+{
+public:
+    virtual ~EventSink() {}
+    virtual void onSymbol(uint32_t symbolId, const string &symbol) = 0;
+    virtual void onTrade(const MatchedOrders &matchedOrders) = 0;
+    virtual void onBookHeader(uint32_t symbolId) = 0;
+    virtual void onDepthRow(uint32_t symbolId, const Limit *bid, const Limit *ask) = 0;
+    virtual void onLevelChange(const BookLevel &level) = 0;
+    virtual void flush() {}
+};
+
+// TextWriter produces the CSV output of the engine:
+//   <symbol>,<price>,<volume>,<aggressive order id>,<passive order id>   for a trade
+//   ===<symbol>===                                                       before the depth of a symbol
+//   <bid price>,<bid volume>,<ask price>,<ask volume>                   for a depth row (a missing side is empty)
+//   L2,<symbol>,<BUY|SELL>,<price>,<volume>                              for a changed level (volume 0: the level is gone)
+// Every line is formatted with to_chars into one reusable buffer, there is no stringstream or string concatenation.
+// The lines either go to an ostream (the buffer is written out every BUFFER_SIZE bytes and on flush),
+// or each line is appended to a vector<string>, this is what run() returns.
+class TextWriter : public EventSink
+{
+public:
+    static const size_t BUFFER_SIZE = 1 << 16;
+
+    TextWriter(ostream &out)
+    {
+        this->out = &out;
+        this->lines = nullptr;
+        buffer.reserve(BUFFER_SIZE + 256);
+    }
+
+    TextWriter(vector<string> &lines)
+    {
+        this->out = nullptr;
+        this->lines = &lines;
+        buffer.reserve(256);
+    }
+
+    ~TextWriter()
+    {
+        flush();
+    }
+
+    void onSymbol(uint32_t symbolId, const string &symbol) override
+    {
+        if (symbolId >= names.size())
+        {
+            names.resize(symbolId + 1);
+        }
+        names[symbolId] = symbol;
+    }
+
+    void onTrade(const MatchedOrders &matchedOrders) override
+    {
+        char *cursor = reserve(names[matchedOrders.symbolId].size() + 64);
+        cursor = writeName(cursor, matchedOrders.symbolId);
+        *cursor++ = ',';
+        cursor = writeTicks(cursor, matchedOrders.price);
+        *cursor++ = ',';
+        cursor = to_chars(cursor, cursor + 12, matchedOrders.volume).ptr;
+        *cursor++ = ',';
+        cursor = to_chars(cursor, cursor + 12, matchedOrders.agressiveOrderId).ptr;
+        *cursor++ = ',';
+        cursor = to_chars(cursor, cursor + 12, matchedOrders.passiveOrderId).ptr;
+        endLine(cursor);
+    }
+
+    void onBookHeader(uint32_t symbolId) override
+    {
+        char *cursor = reserve(names[symbolId].size() + 8);
+        memcpy(cursor, "===", 3);
+        cursor = writeName(cursor + 3, symbolId);
+        memcpy(cursor, "===", 3);
+        endLine(cursor + 3);
+    }
+
+    void onDepthRow(uint32_t, const Limit *bid, const Limit *ask) override
+    {
+        char *cursor = reserve(96);
+        cursor = writeLevel(cursor, bid);
+        *cursor++ = ',';
+        cursor = writeLevel(cursor, ask);
+        endLine(cursor);
+    }
+
+    void onLevelChange(const BookLevel &level) override
+    {
+        char *cursor = reserve(names[level.symbolId].size() + 64);
+        memcpy(cursor, "L2,", 3);
+        cursor = writeName(cursor + 3, level.symbolId);
+        if (level.side == BUY)
+        {
+            memcpy(cursor, ",BUY,", 5);
+            cursor += 5;
+        }
+        else
+        {
+            memcpy(cursor, ",SELL,", 6);
+            cursor += 6;
+        }
+        cursor = writeTicks(cursor, level.price);
+        *cursor++ = ',';
+        cursor = to_chars(cursor, cursor + 12, level.volume).ptr;
+        endLine(cursor);
+    }
+
+    void flush() override
+    {
+        if (out != nullptr && !buffer.empty())
+        {
+            out->write(buffer.data(), buffer.size());
+            out->flush();
+            buffer.clear();
+        }
+    }
+
+private:
+    ostream *out;
+    vector<string> *lines;
+    vector<char> buffer;
+    vector<string> names;
+
+    // Make room for at most n more chars of the current line and return where to write them
+    char *reserve(size_t n)
+    {
+        size_t used = buffer.size();
+        buffer.resize(used + n);
+        return buffer.data() + used;
+    }
+
+    // Close the line that ends at cursor
+    void endLine(char *cursor)
+    {
+        if (lines != nullptr)
+        {
+            lines->emplace_back(buffer.data(), cursor - buffer.data());
+            buffer.clear();
+            return;
+        }
+        *cursor++ = '\n';
+        buffer.resize(cursor - buffer.data());
+        if (buffer.size() >= BUFFER_SIZE)
+        {
+            out->write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+
+    char *writeName(char *cursor, uint32_t symbolId)
+    {
+        const string &name = names[symbolId];
+        memcpy(cursor, name.data(), name.size());
+        return cursor + name.size();
+    }
+
+    char *writeLevel(char *cursor, const Limit *level)
+    {
+        if (level == nullptr)
+        {
+            *cursor++ = ',';
+            return cursor;
+        }
+        cursor = writeTicks(cursor, level->limitPrice);
+        *cursor++ = ',';
+        return to_chars(cursor, cursor + 12, level->totalVolume).ptr;
+    }
+};
+
+// Record types of the binary output
+enum RecordType : uint8_t
+{
+    SYMBOL_RECORD = 1,
+    TRADE_RECORD = 2,
+    DEPTH_RECORD = 3,
+    LEVEL_RECORD = 4
+};
+
+// The binary output is a sequence of fixed-width 32 byte records in the byte order of the host, the first byte is the RecordType.
+// SymbolRecord maps a symbol id to its name, it comes before any other record with that id.
+struct SymbolRecord
+{
+    uint8_t type;
+    uint8_t length;
+    uint8_t reserved[2];
+    uint32_t symbolId;
+    char symbol[24];
+};
+
+// TradeRecord is one fill
+struct TradeRecord
+{
+    uint8_t type;
+    uint8_t reserved[3];
+    uint32_t symbolId;
+    int64_t price;
+    int32_t volume;
+    int32_t aggressiveOrderId;
+    int32_t passiveOrderId;
+    uint32_t reserved2;
+};
+
+// DepthRecord is one row of the end of day depth. flags tells which side is present (DEPTH_HAS_BID, DEPTH_HAS_ASK).
+struct DepthRecord
+{
+    uint8_t type;
+    uint8_t flags;
+    uint8_t reserved[2];
+    uint32_t symbolId;
+    int64_t bidPrice;
+    int64_t askPrice;
+    int32_t bidVolume;
+    int32_t askVolume;
+};
+
+const uint8_t DEPTH_HAS_BID = 1;
+const uint8_t DEPTH_HAS_ASK = 2;
+
+// LevelRecord is an L2 update, the volume and the number of orders a level has after a command (0 when it is gone)
+struct LevelRecord
+{
+    uint8_t type;
+    uint8_t side;
+    uint8_t reserved[2];
+    uint32_t symbolId;
+    int64_t price;
+    int32_t volume;
+    int32_t orders;
+    uint64_t reserved2;
+};
+
+static_assert(sizeof(SymbolRecord) == 32 && sizeof(TradeRecord) == 32 && sizeof(DepthRecord) == 32 && sizeof(LevelRecord) == 32,
+              "binary records are 32 bytes");
+
+// BinaryWriter writes the events as fixed-width records into a buffer that goes to the ostream every BUFFER_SIZE bytes.
+// Nothing is formatted, a trade costs one 32 byte copy. The book header is implied by the first DepthRecord of a symbol.
+class BinaryWriter : public EventSink
+{
+public:
+    static const size_t BUFFER_SIZE = 1 << 16;
+
+    BinaryWriter(ostream &out) : out(out)
+    {
+        buffer.reserve(BUFFER_SIZE);
+    }
+
+    ~BinaryWriter()
+    {
+        flush();
+    }
+
+    void onSymbol(uint32_t symbolId, const string &symbol) override
+    {
+        SymbolRecord record = {};
+        record.type = SYMBOL_RECORD;
+        record.length = (uint8_t)min(symbol.size(), sizeof(record.symbol));
+        record.symbolId = symbolId;
+        memcpy(record.symbol, symbol.data(), record.length);
+        append(&record, sizeof(record));
+    }
+
+    void onTrade(const MatchedOrders &matchedOrders) override
+    {
+        TradeRecord record = {};
+        record.type = TRADE_RECORD;
+        record.symbolId = matchedOrders.symbolId;
+        record.price = matchedOrders.price;
+        record.volume = matchedOrders.volume;
+        record.aggressiveOrderId = matchedOrders.agressiveOrderId;
+        record.passiveOrderId = matchedOrders.passiveOrderId;
+        append(&record, sizeof(record));
+    }
+
+    void onBookHeader(uint32_t) override {}
+
+    void onDepthRow(uint32_t symbolId, const Limit *bid, const Limit *ask) override
+    {
+        DepthRecord record = {};
+        record.type = DEPTH_RECORD;
+        record.symbolId = symbolId;
+        if (bid != nullptr)
+        {
+            record.flags |= DEPTH_HAS_BID;
+            record.bidPrice = bid->limitPrice;
+            record.bidVolume = bid->totalVolume;
+        }
+        if (ask != nullptr)
+        {
+            record.flags |= DEPTH_HAS_ASK;
+            record.askPrice = ask->limitPrice;
+            record.askVolume = ask->totalVolume;
+        }
+        append(&record, sizeof(record));
+    }
+
+    void onLevelChange(const BookLevel &level) override
+    {
+        LevelRecord record = {};
+        record.type = LEVEL_RECORD;
+        record.side = level.side;
+        record.symbolId = level.symbolId;
+        record.price = level.price;
+        record.volume = level.volume;
+        record.orders = level.orders;
+        append(&record, sizeof(record));
+    }
+
+    void flush() override
+    {
+        if (!buffer.empty())
+        {
+            out.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+        out.flush();
+    }
+
+private:
+    ostream &out;
+    vector<char> buffer;
+
+    void append(const void *record, size_t size)
+    {
+        const char *bytes = (const char *)record;
+        buffer.insert(buffer.end(), bytes, bytes + size);
+        if (buffer.size() >= BUFFER_SIZE)
+        {
+            out.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+};
+
+// SideTraits resolves at compile time everything in the matching loop that depends on the side of the incoming order:
+// - opposite: the side of the book the order is matched against
+// - own: the side of the book the remainder rests on
+// - crosses: whether the incoming price reaches the passive price (a buy crosses a lower or equal sell, a sell a higher or equal buy)
+template <Side S>
+struct SideTraits;
+
+template <>
+struct SideTraits<BUY>
+{
+    static PriceLadder<less<int64_t>> &opposite(LimitBook &book) { return book.sellTree; }
+    static PriceLadder<greater<int64_t>> &own(LimitBook &book) { return book.buyTree; }
+    static bool crosses(int64_t price, int64_t passivePrice) { return passivePrice <= price; }
+};
+
+template <>
+struct SideTraits<SELL>
+{
+    static PriceLadder<greater<int64_t>> &opposite(LimitBook &book) { return book.buyTree; }
+    static PriceLadder<less<int64_t>> &own(LimitBook &book) { return book.sellTree; }
+    static bool crosses(int64_t price, int64_t passivePrice) { return passivePrice >= price; }
+};
+
+// The incoming order meets the resting order at handle, the head of limit, and both have the same owner.
+// There is no trade, the self-trade prevention mode of the incoming order says which one gives way (see SelfTradePrevention).
+// A resting order that is cancelled or decremented to 0 leaves the book, an iceberg decremented to 0 shows its next clip.
+void preventSelfTrade(StockOrder *curOrder, LimitBook &book, OrderIndex &orderLookUp, Limit &limit, uint32_t handle)
+{
+    OrderNode &resting = book.orders[handle];
+    bool restingDone = false;
+    if (curOrder->selfTradePrevention == DECREMENT)
+    {
+        int decrement = min(curOrder->volume, resting.volume);
+        curOrder->volume -= decrement;
+        resting.volume -= decrement;
+        limit.totalVolume -= decrement;
+        book.markChanged(resting.side, limit.limitPrice);
+        restingDone = resting.volume == 0 && !(resting.iceberg && book.replenish(limit, handle));
+    }
+    else
+    {
+        if (curOrder->selfTradePrevention != CANCEL_OLDEST)
+        {
+            curOrder->volume = 0;
+        }
+        restingDone = curOrder->selfTradePrevention != CANCEL_NEWEST;
+    }
+    if (restingDone)
+    {
+        orderLookUp.erase(resting.orderId);
+        book.unlinkOrder(limit, handle);
+        book.releaseOrder(handle);
+    }
+}
+
+// The volume a FOK order of side S can get from the book right now, counted until it reaches the volume of the order.
+// It adds up the totalVolume and hiddenVolume of the crossing levels without looking at their orders.
+// If that is enough and the opposite side holds orders of the owner of the order, the queues of the crossing levels are
+// walked too: the orders of its owner do not trade with it, and unless its mode is CANCEL_OLDEST the matching stops at the
+// first of them (the reserves behind it are not reached).
+template <Side S>
+int64_t fillableVolume(const StockOrder *curOrder, LimitBook &book)
+{
+    typedef SideTraits<S> Traits;
+    auto &opposite = Traits::opposite(book);
+    int64_t available = 0;
+    for (Limit *level = opposite.best(); level != nullptr && available < curOrder->volume && Traits::crosses(curOrder->price, level->limitPrice);
+         level = opposite.next(level))
+    {
+        available += level->totalVolume + level->hiddenVolume;
+    }
+    if (available >= curOrder->volume && curOrder->owner != NO_OWNER && book.ownerOrders(S == BUY ? SELL : BUY, curOrder->owner) != 0)
+    {
+        available = 0;
+        for (Limit *level = opposite.best(); level != nullptr && available < curOrder->volume && Traits::crosses(curOrder->price, level->limitPrice);
+             level = opposite.next(level))
+        {
+            int64_t hidden = 0;
+            for (uint32_t handle = level->headOrder; handle != NULL_ORDER; handle = book.orders[handle].nextOrder)
+            {
+                const OrderNode &node = book.orders[handle];
+                if (node.owner == curOrder->owner)
+                {
+                    if (curOrder->selfTradePrevention != CANCEL_OLDEST)
+                    {
+                        return available;
+                    }
+                    continue;
+                }
+                available += node.volume;
+                hidden += node.iceberg ? book.reserves[handle].hiddenVolume : 0;
+            }
+            available += hidden;
+        }
+    }
+    return available;
+}
+
+// The matching kernel for an incoming order of side S (the curOrder is not added to the orderbook yet).
+// It takes the best level of the opposite side and fills against its queue, oldest order first, until the level is empty
+// or curOrder is done, and then moves on to the next best level while the price still crosses.
+// Every fill is appended to vecMatchedOrders. If the volume of curOrder is not 0 at the end, the remainder rests on its own side
+// when the order is GTC, an IOC (or market) remainder is dropped.
+// A FOK order is killed without any fill if fillableVolume is less than its volume.
+// Before every fill the owner of the resting order is compared with the owner of curOrder, which is NEVER_OWNER for an
+// order without one, so the self-trade prevention costs one integer compare per fill (preventSelfTrade is the cold path).
+// When the clip of a passive iceberg fills, its next clip goes to the back of its level and the matching goes on.
+// The remainder of an iceberg order rests as a clip of displayVolume with the rest in reserve.
+// There is no test on the side inside the loops, the compiler generates one kernel per side.
+template <Side S>
+void matchOrderKernel(StockOrder *curOrder, LimitBook &book, OrderIndex &orderLookUp, vector<MatchedOrders> &vecMatchedOrders)
+{
+    typedef SideTraits<S> Traits;
+    auto &opposite = Traits::opposite(book);
+    ENGINE_METRIC(EngineMetrics &metrics = EngineMetrics::local();)
+
+    if (curOrder->timeInForce == FILL_OR_KILL && fillableVolume<S>(curOrder, book) < curOrder->volume)
+    {
+        return;
+    }
+    int selfTradeOwner = curOrder->owner != NO_OWNER ? curOrder->owner : NEVER_OWNER;
+
+    while (curOrder->volume != 0)
+    {
+        Limit *potentialMatchLimit = opposite.best();
+        // Stop if the opposite side is empty or its best price does not cross anymore
+        if (potentialMatchLimit == nullptr || !Traits::crosses(curOrder->price, potentialMatchLimit->limitPrice))
+        {
+            break;
+        }
+        // Fill against the queue of the level, the oldest order is the head
+        while (curOrder->volume != 0 && potentialMatchLimit->headOrder != NULL_ORDER)
+        {
+            uint32_t potentialMatchHandle = potentialMatchLimit->headOrder;
+            OrderNode *potentialMatchOrder = &book.orders[potentialMatchHandle];
+            if (potentialMatchOrder->owner == selfTradeOwner)
+            {
+                preventSelfTrade(curOrder, book, orderLookUp, *potentialMatchLimit, potentialMatchHandle);
+                continue;
+            }
+            int tmp = min(potentialMatchOrder->volume, curOrder->volume);
+            //update the volume of the curOrder
+            curOrder->volume -= tmp;
+            //Update the volume of the potentialMatchOrder (Matched in this case)
+            potentialMatchOrder->volume -= tmp;
+            //Update the limit. (This will helps to keep track of number of volume at that price)
+            potentialMatchLimit->totalVolume -= tmp;
+            book.markChanged(potentialMatchOrder->side, potentialMatchLimit->limitPrice);
+            //Put into the matches object, this will help with the printing
+            vecMatchedOrders.emplace_back(book.symbolId, potentialMatchLimit->limitPrice, tmp, curOrder->orderId, potentialMatchOrder->orderId);
+            ENGINE_METRIC(metrics.fills++;)
+            if (potentialMatchOrder->volume == 0 && !(potentialMatchOrder->iceberg && book.replenish(*potentialMatchLimit, potentialMatchHandle)))
+            {
+                // The passive order is filled, remove it from the level and give the node back to the pool
+                orderLookUp.erase(potentialMatchOrder->orderId);
+                book.unlinkOrder(*potentialMatchLimit, potentialMatchHandle);
+                book.releaseOrder(potentialMatchHandle);
+            }
+        }
+        // An empty level is removed, so best() is always a level with orders
+        if (potentialMatchLimit->size == 0)
+        {
+            ENGINE_METRIC(metrics.levelsSwept++;)
+            opposite.erase(potentialMatchLimit->limitPrice);
+        }
+    }
+
+    //If the curOrer is not equal 0 then we add it to the order LimitBook, at the level with exactly its tick price
+    if (curOrder->volume != 0 && curOrder->timeInForce == GOOD_TILL_CANCEL)
+    {
+        Limit &restingLimit = Traits::own(book).insert(curOrder->price);
+        uint32_t handle = book.orders.allocate();
+        OrderNode &node = book.orders[handle];
+        node.price = curOrder->price;
+        node.orderId = curOrder->orderId;
+        node.volume = curOrder->volume;
+        node.side = S;
+        node.iceberg = false;
+        node.owner = curOrder->owner;
+        node.selfTradePrevention = curOrder->selfTradePrevention;
+        book.addOwnerOrder(S, curOrder->owner);
+        if (curOrder->displayVolume != 0 && curOrder->volume > curOrder->displayVolume)
+        {
+            node.volume = curOrder->displayVolume;
+            book.setReserve(handle, curOrder->displayVolume, curOrder->volume - curOrder->displayVolume);
+        }
+        book.appendOrder(restingLimit, handle);
+        orderLookUp.insert(curOrder->orderId, OrderLocation{book.symbolId, handle});
+    }
+}
+
+// The side of the order is tested once here to pick the matching kernel
+void matchIncoming(StockOrder *curOrder, LimitBook &book, OrderIndex &orderLookUp, vector<MatchedOrders> &vecMatchedOrders)
+{
+    if (curOrder->side == BUY)
+    {
+        matchOrderKernel<BUY>(curOrder, book, orderLookUp, vecMatchedOrders);
+    }
+    else
+    {
+        matchOrderKernel<SELL>(curOrder, book, orderLookUp, vecMatchedOrders);
+    }
+}
+
+// Release the stop orders the trades in vecMatchedOrders trigger and match them right away, in the order they fire.
+// Their trades are appended to vecMatchedOrders and can trigger more stops, this goes on until a round triggers nothing.
+// Each round looks at the new trades only, and the trigger maps only at the stops that fire.
+void triggerStops(LimitBook &book, OrderIndex &orderLookUp, vector<MatchedOrders> &vecMatchedOrders)
+{
+    static thread_local vector<StockOrder> triggered;
+    size_t checked = 0;
+    while (checked < vecMatchedOrders.size() && (!book.buyStops.empty() || !book.sellStops.empty()))
+    {
+        int64_t low = vecMatchedOrders[checked].price;
+        int64_t high = low;
+        for (; checked < vecMatchedOrders.size(); checked++)
+        {
+            low = min(low, vecMatchedOrders[checked].price);
+            high = max(high, vecMatchedOrders[checked].price);
+        }
+        triggered.clear();
+        book.takeTriggeredStops(low, high, triggered);
+        for (StockOrder &order : triggered)
+        {
+            orderLookUp.erase(order.orderId);
+            matchIncoming(&order, book, orderLookUp, vecMatchedOrders);
+        }
+    }
+}
+
+// The function matches an order from the input with the corresponding orders in the opposite side of its book,
+// and then the stop orders its trades trigger. The trades go to the sink in the order they happened.
+void matchOrder(StockOrder *curOrder, EventSink &sink, OrderIndex &orderLookUp, LimitBook &book)
+{
+    //vecMatchedOrders is a vector to store all the matched orderd. This is in the format that helps to print out. 
+    //It is reused by every order of the thread, so matching does not allocate once it has grown.
+    static thread_local vector<MatchedOrders> vecMatchedOrders;
+    vecMatchedOrders.clear();
+    matchIncoming(curOrder, book, orderLookUp, vecMatchedOrders);
+    if (!vecMatchedOrders.empty() && (!book.buyStops.empty() || !book.sellStops.empty()))
+    {
+        triggerStops(book, orderLookUp, vecMatchedOrders);
+    }
+
+    // push the match to the result
+    for (const MatchedOrders &matchedOrders : vecMatchedOrders)
+    {
+        sink.onTrade(matchedOrders);
+    }
+    return;
+}
+
+
+
+//////////////////////////////////////////////////////////QUERY FUNCTION ///////////////////////////////////////////////////////////////////////////
+
+
+// Process Insert query 
+// The function create curOrbject and call matchOrder to find if possible trade can happen
+// The symbol of the command is already interned and books[command.symbolId] exists.
+// A stop order only goes to the trigger map of its book, it is matched when a trade reaches its stop price.
+void processInsertQuery(const Command &command, EventSink &sink, OrderIndex &orderLookUp, vector<LimitBook> &books)
+{
+    StockOrder curOrder(command.orderId, command.side, command.price, command.volume, command.timestamp, command.timeInForce,
+                        command.displayVolume, command.owner, command.selfTradePrevention);
+    if (command.stopPrice != NO_STOP_PRICE)
+    {
+        books[command.symbolId].addStop(curOrder, command.stopPrice);
+        orderLookUp.insert(command.orderId, OrderLocation{command.symbolId, STOP_ORDER});
+        return;
+    }
+    //Check if we can match the order. (For the match order, in this case, 
+    //in code will add the current order if after the match the volume is greater than 0)
+    matchOrder(&curOrder, sink, orderLookUp, books[command.symbolId]);
+    return;
+}
+
+//Process amend query
+//A pull removes the order from the order LimitBook. An amend changes the price and/or volume of the order. 
+//An amend causes the order to lose time priority in the order LimitBook, unless the only change to the 
+//orders that the volume is decreased. If the price of the order is amended, it needs to be re-evaluated for potential matches.
+void processAmendQuery(const Command &command, EventSink &sink, OrderIndex &orderLookUp, vector<LimitBook> &books)
+{
+    int orderId = command.orderId;
+    int64_t priceChange = command.price;
+    int volumeChange = command.volume;
+    //If we can not find order
+    OrderLocation *location = orderLookUp.find(orderId);
+    if (location == nullptr)
+    {
+        return;
+    }
+    LimitBook &book = books[location->symbolId];
+    uint32_t handle = location->handle;
+    if (handle == STOP_ORDER)
+    {
+        // A waiting stop order keeps its stop price and gets the new price and volume. A stop market order stays a market
+        // order, the price of the amend is ignored. Like a resting order, it only keeps its place among the stops of its
+        // stop price when the volume goes down; otherwise it goes behind them, with the timestamp of the amend.
+        StockOrder *stop = book.findStop(orderId);
+        bool market = stop->price == MARKET_BUY_PRICE || stop->price == MARKET_SELL_PRICE;
+        bool keepsPriority = (market || stop->price == priceChange) && volumeChange <= stop->volume;
+        if (!market)
+        {
+            stop->price = priceChange;
+        }
+        stop->volume = volumeChange;
+        if (!keepsPriority)
+        {
+            book.requeueStop(orderId, command.timestamp);
+        }
+        return;
+    }
+    OrderNode &node = book.orders[handle];
+
+    // The volume of an iceberg is its clip and its reserve, it keeps its clip size through the amend
+    IcebergReserve *reserve = node.iceberg ? &book.reserves[handle] : nullptr;
+    int displayVolume = reserve != nullptr ? reserve->displayVolume : 0;
+    int hiddenVolume = reserve != nullptr ? reserve->hiddenVolume : 0;
+
+    // If the volume decrease (or stay the same), and the price does not change. The priority of the order will remain the same,
+    // so the node is updated in place and keeps its position in the queue. An iceberg loses its reserve first.
+    // The volume is positive, parseCommand rejects an AMEND to 0.
+    if (node.price == priceChange && volumeChange <= node.volume + hiddenVolume)
+    {
+        int shown = min(node.volume, volumeChange);
+        Limit *limit = book.levelOf(handle);
+        limit->totalVolume -= node.volume - shown;
+        book.markChanged(node.side, node.price);
+        node.volume = shown;
+        if (reserve != nullptr)
+        {
+            limit->hiddenVolume -= reserve->hiddenVolume - (volumeChange - shown);
+            reserve->hiddenVolume = volumeChange - shown;
+        }
+        return;
+    }
+
+    // The amend incrase the volume or changes the price, so remove the order from the order LimitBook
+    Side side = node.side;
+    int owner = node.owner;
+    SelfTradePrevention selfTradePrevention = node.selfTradePrevention;
+    book.removeOrder(handle);
+    orderLookUp.erase(orderId);
+    //Match the order again with the new price and volume, it goes to the back of the queue like a new order
+    StockOrder curOrder(orderId, side, priceChange, volumeChange, command.timestamp, GOOD_TILL_CANCEL, displayVolume, owner,
+                        selfTradePrevention);
+    matchOrder(&curOrder, sink, orderLookUp, book);
+    return;
+}
+
+// Pull query 
+// The query will remove the order from the order LimitBook 
+// The order is found through orderLookUp and unlinked from its level in O(1)
+void processPullQuery(const Command &command, OrderIndex &orderLookUp, vector<LimitBook> &books)
+{
+    int orderId = command.orderId;
+    OrderLocation *location = orderLookUp.find(orderId);
+    if (location != nullptr)
+    {
+        if (location->handle == STOP_ORDER)
+        {
+            books[location->symbolId].removeStop(orderId);
+        }
+        else
+        {
+            books[location->symbolId].removeOrder(location->handle);
+        }
+        orderLookUp.erase(orderId);
+    }
+}
+
+// Write an L2 update for every level the last command changed, with the volume the level has now.
+// A level changed several times by the command (e.g. by a few fills) gives one update.
+void publishLevelChanges(EventSink &sink, LimitBook &book)
+{
+    vector<pair<Side, int64_t>> &changed = book.changedLevels;
+    sort(changed.begin(), changed.end());
+    changed.erase(unique(changed.begin(), changed.end()), changed.end());
+    for (const pair<Side, int64_t> &level : changed)
+    {
+        Limit *limit = level.first == BUY ? book.buyTree.find(level.second) : book.sellTree.find(level.second);
+        BookLevel update = book.view(level.first, limit);
+        update.price = level.second;
+        sink.onLevelChange(update);
+    }
+    changed.clear();
+}
+
+// RejectCounts counts the AMEND and PULL commands for an order id that is not in the book. A stream of cancels races
+// with the fills, so there can be many of them: they are counted and reported once by the engine at the end
+// (a line on stderr for each of them costs more than the command).
+class RejectCounts
+{
+public:
+    uint64_t amends = 0;
+    uint64_t pulls = 0;
+
+    void add(const RejectCounts &other)
+    {
+        amends += other.amends;
+        pulls += other.pulls;
+    }
+
+    void report() const
+    {
+        if (amends != 0)
+        {
+            cerr << "Invalid amend request: " << amends << " AMEND for an unknown order" << endl;
+        }
+        if (pulls != 0)
+        {
+            cerr << "Invalid pull request: " << pulls << " PULL for an unknown order" << endl;
+        }
+    }
+};
+
+// Process one parsed command against the books and return the book it changed (nullptr for an unknown order).
+// The symbol of an INSERT is already interned and books[command.symbolId] exists. An AMEND or PULL for an unknown order
+// is counted in rejects.
+// The cached top of the book is refreshed and, if the book tracks its levels, the changed levels go to the sink.
+LimitBook *processCommand(const Command &command, EventSink &sink, OrderIndex &orderLookUp, vector<LimitBook> &books, RejectCounts &rejects)
+{
+    ENGINE_METRIC(EngineMetrics &metrics = EngineMetrics::local(); uint64_t fillsBefore = metrics.fills; auto started = chrono::steady_clock::now();)
+    LimitBook *book = nullptr;
+    if (command.type == INSERT_COMMAND)
+    {
+        book = &books[command.symbolId];
+        processInsertQuery(command, sink, orderLookUp, books);
+    }
+    else if (command.type == AMEND_COMMAND || command.type == PULL_COMMAND)
+    {
+        // The order is looked up first, a PULL or an amend that fills the order removes it from orderLookUp
+        OrderLocation *location = orderLookUp.find(command.orderId);
+        book = location != nullptr ? &books[location->symbolId] : nullptr;
+        if (location == nullptr)
+        {
+            (command.type == AMEND_COMMAND ? rejects.amends : rejects.pulls)++;
+        }
+        else if (command.type == AMEND_COMMAND)
+        {
+            processAmendQuery(command, sink, orderLookUp, books);
+        }
+        else
+        {
+            processPullQuery(command, orderLookUp, books);
+        }
+    }
+    if (book != nullptr)
+    {
+        book->refreshTop();
+        if (!book->changedLevels.empty())
+        {
+            publishLevelChanges(sink, *book);
+        }
+    }
+#ifdef ENGINE_METRICS
+    if (command.type != INVALID_COMMAND)
+    {
+        uint64_t fills = metrics.fills - fillsBefore;
+        MetricCommand kind = command.type == INSERT_COMMAND ? (fills != 0 ? INSERT_MATCHED_METRIC : INSERT_RESTING_METRIC)
+                           : command.type == AMEND_COMMAND ? AMEND_METRIC : PULL_METRIC;
+        recordCommandMetrics(metrics, kind, fills, started);
+    }
+#endif
+    return book;
+}
+
+//The function print the remaining stock of one book, the bid and ask levels are paired from the best price to the worst one.
+void outPutSymbol(EventSink &sink, LimitBook &book, uint32_t symbolId)
+{
+    //If there exists stock of the symbol 
+    if (!book.buyTree.empty() || !book.sellTree.empty())
+    {
+        sink.onBookHeader(symbolId);
+    }  
+    //Walk both sides from the best price to the worst one. 
+    Limit *it1 = book.buyTree.best();
+    Limit *it2 = book.sellTree.best();
+    while (it1 != nullptr || it2 != nullptr)
+    {
+        //Pair the next level of both sides, a side without more levels is left empty
+        sink.onDepthRow(symbolId, it1, it2);
+        if (it1 != nullptr)
+        {
+            it1 = book.buyTree.next(it1);
+        }
+        if (it2 != nullptr)
+        {
+            it2 = book.sellTree.next(it2);
+        }
+    }
+}
+
+//The function get summary of bests matches of stocks sorted by symbols and print the remaining stock. 
+void outPutPerSymbol(EventSink &sink, vector<LimitBook> &books, const SymbolTable &symbols)
+{
+    //Loop through all the symbols in alphabetical order
+    for (uint32_t symbolId : symbols.sortedIds())
+    { 
+        outPutSymbol(sink, books[symbolId], symbolId);
+    }
+}
+
+// SpscRing is a bounded queue between exactly one producer thread and one consumer thread, without locks.
+// The producer only writes tail and the consumer only writes head, each index is on its own cache line and each side
+// keeps a cached copy of the other index, so the shared lines are only read again when the ring looks full or empty.
+// A full ring makes the producer wait, so a slow stage holds back the stage in front of it (back-pressure).
+// fullStalls and emptyStalls count how often the producer and the consumer had to wait.
+template<typename T, size_t CAPACITY>
+class SpscRing
+{
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "the capacity must be a power of two");
+
+public:
+    size_t fullStalls = 0;
+    size_t emptyStalls = 0;
+
+    void push(const T &item)
+    {
+        size_t tail = tailIndex.load(memory_order_relaxed);
+        if (tail - cachedHead == CAPACITY)
+        {
+            cachedHead = headIndex.load(memory_order_acquire);
+            if (tail - cachedHead == CAPACITY)
+            {
+                fullStalls++;
+                while (tail - cachedHead == CAPACITY)
+                {
+                    this_thread::yield();
+                    cachedHead = headIndex.load(memory_order_acquire);
+                }
+            }
+        }
+        items[tail & (CAPACITY - 1)] = item;
+        tailIndex.store(tail + 1, memory_order_release);
+    }
+
+    // Take the oldest item if there is one, without waiting
+    bool tryPop(T &item)
+    {
+        size_t head = headIndex.load(memory_order_relaxed);
+        if (head == cachedTail)
+        {
+            cachedTail = tailIndex.load(memory_order_acquire);
+            if (head == cachedTail)
+            {
+                return false;
+            }
+        }
+        item = items[head & (CAPACITY - 1)];
+        headIndex.store(head + 1, memory_order_release);
+        return true;
+    }
+
+    T pop()
+    {
+        size_t head = headIndex.load(memory_order_relaxed);
+        if (head == cachedTail)
+        {
+            cachedTail = tailIndex.load(memory_order_acquire);
+            if (head == cachedTail)
+            {
+                emptyStalls++;
+                while (head == cachedTail)
+                {
+                    this_thread::yield();
+                    cachedTail = tailIndex.load(memory_order_acquire);
+                }
+            }
+        }
+        T item = items[head & (CAPACITY - 1)];
+        headIndex.store(head + 1, memory_order_release);
+        return item;
+    }
+
+    size_t pushed() const
+    {
+        return tailIndex.load(memory_order_acquire);
+    }
+
+private:
+    alignas(64) atomic<size_t> tailIndex{0};
+    size_t cachedHead = 0;
+    alignas(64) atomic<size_t> headIndex{0};
+    size_t cachedTail = 0;
+    alignas(64) T items[CAPACITY];
+};
+
+//////////////////////////////////////////////////////////SNAPSHOT///////////////////////////////////////////////////////////////////////////
+// A snapshot is the whole state of a MatchingEngine in one file, in the byte order of the host:
+// - SnapshotHeader: timestamp is the number of input lines the snapshot includes
+// - the symbols in id order, each as one length byte and the name
+// - orderCount SnapshotOrder records: book by book, each side from the best level to the worst one and each level
+//   from the oldest order to the newest one. Appending them in file order rebuilds the time priority of every level.
+// A restart loads the snapshot and only replays the input after the first timestamp lines.
+// The volume of an iceberg record is its displayed clip, displayVolume and hiddenVolume are its reserve (0 for other orders).
+// The waiting stop orders of a book follow its resting orders in the order they fire, stop is set on their records.
+const char SNAPSHOT_MAGIC[8] = {'O', 'B', 'S', 'N', 'A', 'P', '0', '4'};
+
+struct SnapshotHeader
+{
+    char magic[8];
+    int32_t timestamp;
+    uint32_t symbolCount;
+    uint64_t orderCount;
+};
+
+struct SnapshotOrder
+{
+    uint32_t symbolId;
+    int32_t orderId;
+    int64_t price;
+    int32_t volume;
+    uint8_t side;
+    uint8_t stop;
+    uint8_t timeInForce;
+    uint8_t selfTradePrevention;
+    int32_t displayVolume;
+    int32_t hiddenVolume;
+    int64_t stopPrice;
+    int32_t timestamp;
+    int32_t owner;
+};
+
+static_assert(sizeof(SnapshotHeader) == 24 && sizeof(SnapshotOrder) == 48, "the snapshot header is 24 bytes and an order 48");
+
+// Set by SIGUSR2, the engine writes a snapshot after the line it is processing
+volatile sig_atomic_t snapshotRequested = 0;
+
+//////////////////////////////////////////////////////////JOURNAL///////////////////////////////////////////////////////////////////////////
+// The journal is an append-only file of JournalRecords in the byte order of the host: every command the engine processed,
+// decoded, with the timestamp it got. Replaying it into new books (MatchingEngine::recoverJournal) gives the same books
+// and the same trades, the lines that were not commands are not in it.
+struct JournalRecord
+{
+    int32_t timestamp;
+    uint8_t type;
+    uint8_t side;
+    uint8_t symbolLength;
+    uint8_t timeInForce;
+    int32_t orderId;
+    int32_t volume;
+    int32_t displayVolume;
+    int32_t owner;
+    int64_t price;
+    int64_t stopPrice;
+    char symbol[MAX_SYMBOL_LENGTH + 1];
+    uint8_t selfTradePrevention;
+    uint8_t reserved[7];
+};
+
+static_assert(sizeof(JournalRecord) == 64, "journal records are 64 bytes");
+
+// Journal appends the commands to the journal file with group commit on its own thread.
+// The matching thread only copies the record into an SpscRing (it waits only when the writer is RING_SIZE records behind).
+// The writer thread collects the records and writes them with one write() and one fsync() per group: when groupSize
+// records are waiting, or when the oldest waiting record is groupDelay old. The engine does not wait for the sync, and
+// the sync does not wait for the output: a crash loses at most the last group of commands, and the trades of the
+// commands whose output was still buffered (recovery does not write them again, see ReplaySink).
+// A write or sync that fails stops the journal for good, append returns false from then on and the engine stops (see
+// MatchingEngine::process), so the output never runs ahead of the journal by more than one group.
+class Journal
+{
+public:
+    static const size_t RING_SIZE = 1 << 14;
+    typedef SpscRing<JournalRecord, RING_SIZE> Ring;
+
+    Journal() : ring(new Ring()) {}
+
+    ~Journal()
+    {
+        close();
+    }
+
+    // Open the journal for appending and start the writer. A record cut in half by a crash is removed from the end first,
+    // so the new records stay aligned.
+    bool open(const char *path, size_t groupSize, int64_t groupMicros)
+    {
+#ifdef _WIN32
+        fd = _open(path, _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        fd = ::open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+#endif
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size % sizeof(JournalRecord) != 0)
+        {
+#ifdef _WIN32
+            _chsize_s(fd, info.st_size - info.st_size % sizeof(JournalRecord));
+#else
+            if (ftruncate(fd, info.st_size - info.st_size % sizeof(JournalRecord)) != 0)
+            {
+                return false;
+            }
+#endif
+        }
+        this->groupSize = max<size_t>(1, groupSize);
+        this->groupDelay = chrono::microseconds(max<int64_t>(1, groupMicros));
+        writer = thread([this]() { writeLoop(); });
+        return true;
+    }
+
+    // Queue the command for the writer. Return false if the journal failed, the command is not journaled then.
+    bool append(const Command &command)
+    {
+        if (failure.load(memory_order_relaxed))
+        {
+            return false;
+        }
+        JournalRecord record = {};
+        record.timestamp = command.timestamp;
+        record.type = command.type;
+        record.side = command.side;
+        record.timeInForce = command.timeInForce;
+        record.orderId = command.orderId;
+        record.volume = command.volume;
+        record.displayVolume = command.displayVolume;
+        record.price = command.price;
+        record.stopPrice = command.stopPrice;
+        record.owner = command.owner;
+        record.selfTradePrevention = command.selfTradePrevention;
+        if (command.type == INSERT_COMMAND)
+        {
+            record.symbolLength = command.symbolLength;
+            memcpy(record.symbol, command.symbol, command.symbolLength);
+        }
+        ring->push(record);
+        return true;
+    }
+
+    bool failed() const
+    {
+        return failure.load(memory_order_acquire);
+    }
+
+    // Write and sync everything appended so far and stop the writer. Return false if a write or a sync failed.
+    bool close()
+    {
+        if (writer.joinable())
+        {
+            stopping.store(true, memory_order_release);
+            writer.join();
+        }
+        if (fd >= 0)
+        {
+#ifdef _WIN32
+            _close(fd);
+#else
+            ::close(fd);
+#endif
+            fd = -1;
+        }
+        return !failed();
+    }
+
+private:
+    unique_ptr<Ring> ring;
+    thread writer;
+    atomic<bool> stopping{false};
+    atomic<bool> failure{false};
+    int fd = -1;
+    size_t groupSize = 1;
+    chrono::microseconds groupDelay{1};
+
+    void writeLoop()
+    {
+        vector<JournalRecord> group;
+        group.reserve(groupSize);
+        chrono::steady_clock::time_point oldest;
+        while (true)
+        {
+            // Everything appended before stopping was set is in the ring when it is drained after reading the flag
+            bool stop = stopping.load(memory_order_acquire);
+            JournalRecord record;
+            while (group.size() < groupSize && ring->tryPop(record))
+            {
+                if (group.empty())
+                {
+                    oldest = chrono::steady_clock::now();
+                }
+                group.push_back(record);
+            }
+            bool due = group.size() >= groupSize || (!group.empty() && chrono::steady_clock::now() - oldest >= groupDelay);
+            if (due || (stop && !group.empty()))
+            {
+                commit(group);
+                continue;
+            }
+            if (stop)
+            {
+                return;
+            }
+            this_thread::sleep_for(min<chrono::microseconds>(groupDelay / 4 + chrono::microseconds(1), chrono::microseconds(50)));
+        }
+    }
+
+    // Write the group and sync it. Once the journal failed the groups are dropped: the writer keeps draining the ring,
+    // so an append that was waiting for room does not wait forever.
+    void commit(vector<JournalRecord> &group)
+    {
+        if (!failure.load(memory_order_relaxed) && !(writeGroup(group) && syncFile()))
+        {
+            cerr << "Can not write the journal, the engine stops" << endl;
+            failure.store(true, memory_order_release);
+        }
+        group.clear();
+    }
+
+    bool writeGroup(const vector<JournalRecord> &group)
+    {
+        const char *data = (const char *)group.data();
+        size_t remaining = group.size() * sizeof(JournalRecord);
+        while (remaining > 0)
+        {
+#ifdef _WIN32
+            int written = _write(fd, data, (unsigned)remaining);
+#else
+            ssize_t written = ::write(fd, data, remaining);
+#endif
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            data += written;
+            remaining -= written;
+        }
+        return true;
+    }
+
+    bool syncFile()
+    {
+#ifdef _WIN32
+        return _commit(fd) == 0;
+#else
+        return fsync(fd) == 0;
+#endif
+    }
+};
+
+// LineProcessor is what the input readers (run, runStream, runReplay) feed:
+// - processLine: one input line
+// - flush: the input read so far is processed, the output of it should be written
+// - finish: the input is done, write the depth of every symbol
+class LineProcessor
+{
+public:
+    virtual ~LineProcessor() {}
+    virtual void processLine(string_view line) = 0;
+    virtual void flush() = 0;
+    virtual void finish() = 0;
+};
+
+// FillCollector is the sink of MatchingEngine::processBatch, it appends the trades to the fills of the batch
+// and passes every other event on to the sink of the engine.
+class FillCollector : public EventSink
+{
+public:
+    FillCollector(EventSink &next, vector<MatchedOrders> &fills) : next(next), fills(fills) {}
+
+    void onSymbol(uint32_t symbolId, const string &symbol) override
+    {
+        next.onSymbol(symbolId, symbol);
+    }
+    void onTrade(const MatchedOrders &matchedOrders) override
+    {
+        fills.push_back(matchedOrders);
+    }
+    void onBookHeader(uint32_t symbolId) override
+    {
+        next.onBookHeader(symbolId);
+    }
+    void onDepthRow(uint32_t symbolId, const Limit *bid, const Limit *ask) override
+    {
+        next.onDepthRow(symbolId, bid, ask);
+    }
+    void onLevelChange(const BookLevel &level) override
+    {
+        next.onLevelChange(level);
+    }
+
+private:
+    EventSink &next;
+    vector<MatchedOrders> &fills;
+};
+
+// ReplaySink is the sink of MatchingEngine::recoverJournal. The trades and the L2 updates of the recovered commands are
+// not written again, only the new symbols are passed on so the ids of the output match. So the output is at most once:
+// the run that wrote the journal only wrote them out as far as its writer flushed (a TextWriter or BinaryWriter holds up
+// to BUFFER_SIZE bytes), and its journal can be synced further than that. The trades of the last commands before a crash
+// can be lost, a consumer that needs all of them has to reconcile them with its own records.
+class ReplaySink : public EventSink
+{
+public:
+    ReplaySink(EventSink &next) : next(next) {}
+
+    void onSymbol(uint32_t symbolId, const string &symbol) override
+    {
+        next.onSymbol(symbolId, symbol);
+    }
+    void onTrade(const MatchedOrders &) override {}
+    void onBookHeader(uint32_t) override {}
+    void onDepthRow(uint32_t, const Limit *, const Limit *) override {}
+    void onLevelChange(const BookLevel &) override {}
+
+private:
+    EventSink &next;
+};
+
+// MatchingEngine holds the state of the engine, so commands can be fed one at a time as they arrive.
+// - orderLookUp: the map from order id to the resting order node
+// - symbols: the symbol table, it gives every symbol a dense id
+// - books: the LimitBook of every symbol, indexed by the symbol id
+// - sink: receives the trades, the L2 updates if levelUpdates is set and, at the end, the depth of every symbol
+// - timestamp: the sequence number of the next command
+class MatchingEngine : public LineProcessor
+{
+public:
+    OrderIndex orderLookUp;
+    SymbolTable symbols;
+    vector<LimitBook> books;
+    EventSink &sink;
+    int timestamp;
+    bool levelUpdates;
+    // With snapshotPath set, a snapshot goes there at the end of the input, when snapshotRequested is set
+    // and, with snapshotEvery set, after every snapshotEvery input lines
+    string snapshotPath;
+    int snapshotEvery;
+    // Input lines that are already in the restored snapshot or journal, processLine skips them
+    int skipLines;
+    // Every command is appended to the journal before it is processed, when it is set.
+    // If the journal fails, the engine stops processing commands and finish() does not write the depth.
+    Journal *journal = nullptr;
+    // The AMEND and PULL commands for an unknown order, finish() reports them
+    RejectCounts rejects;
+
+    MatchingEngine(EventSink &sink, bool levelUpdates = false) : sink(sink)
+    {
+        this->timestamp = 0;
+        this->levelUpdates = levelUpdates;
+        this->snapshotEvery = 0;
+        this->skipLines = 0;
+    }
+
+    // Process one command. The command gets the next timestamp.
+    void process(Command &command)
+    {
+        process(command, sink);
+    }
+
+    // Process one command with its events going to out
+    void process(Command &command, EventSink &out)
+    {
+        command.timestamp = timestamp++;
+        if (journal != nullptr && command.type != INVALID_COMMAND && !journal->append(command))
+        {
+            return;
+        }
+        if (command.type == INSERT_COMMAND)
+        {
+            command.symbolId = internSymbol(command.symbolView());
+        }
+        processCommand(command, out, orderLookUp, books, rejects);
+    }
+
+    // Return the book of the symbol for the market data queries (topBid, topAsk, depth), or nullptr for an unknown symbol.
+    // The book is only consistent between two commands, so the queries belong on the thread that calls process(). A
+    // ShardedEngine writes its books on the worker threads, they can only be queried after drain(). fuzz.cpp checks the
+    // queries against the L2 updates and the end of day depth (checkMarketData).
+    LimitBook *bookOf(string_view symbol)
+    {
+        uint32_t symbolId;
+        return symbols.find(symbol, symbolId) ? &books[symbolId] : nullptr;
+    }
+
+    // Parse and process one input line. A line that is not a command still uses a timestamp, like in run().
+    void processLine(string_view line) override
+    {
+        if (skipLines > 0)
+        {
+            skipLines--;
+            return;
+        }
+        Command command;
+        if (parseCommand(line, command))
+        {
+            process(command);
+        }
+        else
+        {
+            timestamp++;
+        }
+        if ((snapshotEvery > 0 && timestamp % snapshotEvery == 0) || snapshotRequested)
+        {
+            writeSnapshot();
+        }
+    }
+
+    // Write the state to path. The sink is flushed first, so the output of every line in the snapshot is written out.
+    // The file is written next to path and renamed over it at the end, a crash never leaves half a snapshot behind.
+    bool saveSnapshot(const string &path)
+    {
+        sink.flush();
+        string partialPath = path + ".tmp";
+        ofstream out(partialPath, ios::binary | ios::trunc);
+        if (!out)
+        {
+            return false;
+        }
+        SnapshotHeader header = {};
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.timestamp = timestamp;
+        header.symbolCount = (uint32_t)symbols.size();
+        out.write((const char *)&header, sizeof(header));
+        for (uint32_t symbolId = 0; symbolId < symbols.size(); symbolId++)
+        {
+            const string &name = symbols.name(symbolId);
+            uint8_t length = (uint8_t)name.size();
+            out.write((const char *)&length, 1);
+            out.write(name.data(), length);
+        }
+        vector<SnapshotOrder> records;
+        records.reserve(4096);
+        for (LimitBook &book : books)
+        {
+            for (Limit *level = book.buyTree.best(); level != nullptr; level = book.buyTree.next(level))
+            {
+                header.orderCount += writeLevel(out, book, *level, records);
+            }
+            for (Limit *level = book.sellTree.best(); level != nullptr; level = book.sellTree.next(level))
+            {
+                header.orderCount += writeLevel(out, book, *level, records);
+            }
+            header.orderCount += writeStops(out, book.symbolId, book.buyStops, 1, records) +
+                                 writeStops(out, book.symbolId, book.sellStops, -1, records);
+        }
+        out.write((const char *)records.data(), records.size() * sizeof(SnapshotOrder));
+        out.seekp(0);
+        out.write((const char *)&header, sizeof(header));
+        out.close();
+        if (!out)
+        {
+            return false;
+        }
+#ifdef _WIN32
+        remove(path.c_str());
+#endif
+        return rename(partialPath.c_str(), path.c_str()) == 0;
+    }
+
+    // Replay the journal at path: every record from the current timestamp on is processed with the timestamp it had.
+    // Their trades and L2 updates are not written again, even the ones the crashed run never wrote out (see ReplaySink).
+    // Records before the timestamp are skipped, they are already in a restored snapshot.
+    // The input lines up to the last record are skipped afterwards, like after a snapshot.
+    bool recoverJournal(const string &path)
+    {
+        ifstream in(path, ios::binary);
+        if (!in)
+        {
+            return false;
+        }
+        vector<JournalRecord> records(4096);
+        ReplaySink replay(sink);
+        while (in)
+        {
+            in.read((char *)records.data(), records.size() * sizeof(JournalRecord));
+            // A record cut in half at the end is dropped
+            size_t count = (size_t)in.gcount() / sizeof(JournalRecord);
+            for (size_t i = 0; i < count; i++)
+            {
+                const JournalRecord &record = records[i];
+                if (record.timestamp < timestamp)
+                {
+                    continue;
+                }
+                Command command = {};
+                command.type = (CommandType)record.type;
+                command.side = (Side)record.side;
+                command.timeInForce = (TimeInForce)record.timeInForce;
+                command.symbolLength = min<uint8_t>(record.symbolLength, MAX_SYMBOL_LENGTH);
+                memcpy(command.symbol, record.symbol, command.symbolLength);
+                command.orderId = record.orderId;
+                command.volume = record.volume;
+                command.displayVolume = record.displayVolume;
+                command.price = record.price;
+                command.stopPrice = record.stopPrice;
+                command.owner = record.owner;
+                command.selfTradePrevention = (SelfTradePrevention)record.selfTradePrevention;
+                timestamp = record.timestamp;
+                process(command, replay);
+            }
+        }
+        skipLines = timestamp;
+        return true;
+    }
+
+    // Load a snapshot into this engine, which has to be new. The lines the snapshot includes are skipped by processLine,
+    // so the same input can be fed again from the start and only its tail is processed.
+    // Return false for a file that is not a snapshot, is cut short or has an order of an unknown symbol or side.
+    // The engine may then hold part of the snapshot and is not used.
+    bool loadSnapshot(const string &path)
+    {
+        ifstream in(path, ios::binary);
+        SnapshotHeader header;
+        if (!in.read((char *)&header, sizeof(header)) || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0)
+        {
+            return false;
+        }
+        char name[256];
+        for (uint32_t symbolId = 0; symbolId < header.symbolCount; symbolId++)
+        {
+            uint8_t length;
+            // The symbols are stored by id, a name that is already known would shift the ids of the orders
+            if (!in.read((char *)&length, 1) || !in.read(name, length) || internSymbol(string_view(name, length)) != symbolId)
+            {
+                return false;
+            }
+        }
+        vector<SnapshotOrder> records(4096);
+        for (uint64_t loaded = 0; loaded < header.orderCount;)
+        {
+            size_t count = (size_t)min<uint64_t>(records.size(), header.orderCount - loaded);
+            if (!in.read((char *)records.data(), count * sizeof(SnapshotOrder)))
+            {
+                return false;
+            }
+            for (size_t i = 0; i < count; i++)
+            {
+                const SnapshotOrder &record = records[i];
+                // A record of a damaged file must not index past the books
+                if (record.symbolId >= header.symbolCount || (record.side != BUY && record.side != SELL))
+                {
+                    return false;
+                }
+                if (record.stop)
+                {
+                    StockOrder order(record.orderId, (Side)record.side, record.price, record.volume, record.timestamp,
+                                     (TimeInForce)record.timeInForce, record.displayVolume, record.owner, (SelfTradePrevention)record.selfTradePrevention);
+                    books[record.symbolId].addStop(order, record.stopPrice);
+                    orderLookUp.insert(record.orderId, OrderLocation{record.symbolId, STOP_ORDER});
+                    continue;
+                }
+                uint32_t handle = books[record.symbolId].restOrder((Side)record.side, record.price, record.orderId, record.volume, record.owner,
+                                                                    (SelfTradePrevention)record.selfTradePrevention, record.displayVolume,
+                                                                    record.hiddenVolume);
+                orderLookUp.insert(record.orderId, OrderLocation{record.symbolId, handle});
+            }
+            loaded += count;
+        }
+        for (LimitBook &book : books)
+        {
+            book.refreshTop();
+            book.changedLevels.clear();
+        }
+        timestamp = header.timestamp;
+        skipLines = header.timestamp;
+        return true;
+    }
+
+    void flush() override
+    {
+        sink.flush();
+    }
+
+    // Print out the unmatched pairs group by symbol alphabetically and flush the sink
+    void finish() override
+    {
+        rejects.report();
+        if (journal != nullptr && journal->failed())
+        {
+            sink.flush();
+            return;
+        }
+        if (!snapshotPath.empty())
+        {
+            writeSnapshot();
+        }
+        outPutPerSymbol(sink, books, symbols);
+        sink.flush();
+    }
+
+    // Return the id of the symbol, a new symbol gets a new empty book.
+    // Orders come in runs on the same symbol, so the last symbol is compared first and the hash lookup is skipped for a repeat.
+    uint32_t internSymbol(string_view symbol)
+    {
+        if (lastSymbolId < books.size() && symbol == lastSymbol)
+        {
+            return lastSymbolId;
+        }
+        uint32_t symbolId = symbols.intern(symbol);
+        if (symbolId == books.size())
+        {
+            books.emplace_back();
+            books.back().symbolId = symbolId;
+            books.back().trackLevels = levelUpdates;
+            sink.onSymbol(symbolId, symbols.name(symbolId));
+        }
+        lastSymbol = symbols.name(symbolId);
+        lastSymbolId = symbolId;
+        return symbolId;
+    }
+
+    // Process a burst of decoded commands in one call and append their fills to fills, in the order they happen.
+    // The commands get consecutive timestamps, like lines do. fills gets room for one fill per command up front, so a burst
+    // rarely grows it. It grows to at least twice its capacity, so a caller that keeps appending bursts to the same vector
+    // copies it O(log n) times and not once per burst. The trades go to fills instead of the sink; new symbols and
+    // L2 updates still go to the sink.
+    // Return the number of fills of the batch.
+    size_t processBatch(Command *commands, size_t count, vector<MatchedOrders> &fills)
+    {
+        size_t first = fills.size();
+        if (fills.capacity() < first + count)
+        {
+            fills.reserve(max(first + count, 2 * fills.capacity()));
+        }
+        FillCollector collector(sink, fills);
+        for (size_t i = 0; i < count; i++)
+        {
+            Command &command = commands[i];
+            command.timestamp = timestamp++;
+            if (journal != nullptr && command.type != INVALID_COMMAND && !journal->append(command))
+            {
+                break;
+            }
+            if (command.type == INSERT_COMMAND)
+            {
+                command.symbolId = internSymbol(command.symbolView());
+            }
+            processCommand(command, collector, orderLookUp, books, rejects);
+        }
+        return fills.size() - first;
+    }
+
+private:
+    void writeSnapshot()
+    {
+        snapshotRequested = 0;
+        if (!saveSnapshot(snapshotPath))
+        {
+            cerr << "Can not write the snapshot " << snapshotPath << endl;
+        }
+    }
+
+    // Add the orders of the level to records, from the oldest to the newest, and write records out when it is full
+    static size_t writeLevel(ofstream &out, LimitBook &book, const Limit &level, vector<SnapshotOrder> &records)
+    {
+        size_t count = 0;
+        for (uint32_t handle = level.headOrder; handle != NULL_ORDER; handle = book.orders[handle].nextOrder)
+        {
+            const OrderNode &node = book.orders[handle];
+            SnapshotOrder record = {};
+            record.symbolId = book.symbolId;
+            record.orderId = node.orderId;
+            record.price = node.price;
+            record.volume = node.volume;
+            record.side = node.side;
+            record.owner = node.owner;
+            record.selfTradePrevention = node.selfTradePrevention;
+            if (node.iceberg)
+            {
+                const IcebergReserve &reserve = book.reserves[handle];
+                record.displayVolume = reserve.displayVolume;
+                record.hiddenVolume = reserve.hiddenVolume;
+            }
+            appendRecord(out, record, records);
+            count++;
+        }
+        return count;
+    }
+
+    // Add the waiting stops of one side to records in the order they fire, sign turns the key back into the stop price
+    static size_t writeStops(ofstream &out, uint32_t symbolId, const map<pair<int64_t, int>, StockOrder> &stops, int64_t sign,
+                             vector<SnapshotOrder> &records)
+    {
+        for (const auto &stop : stops)
+        {
+            const StockOrder &order = stop.second;
+            SnapshotOrder record = {};
+            record.symbolId = symbolId;
+            record.orderId = order.orderId;
+            record.price = order.price;
+            record.volume = order.volume;
+            record.side = order.side;
+            record.stop = 1;
+            record.timeInForce = order.timeInForce;
+            record.displayVolume = order.displayVolume;
+            record.stopPrice = sign * stop.first.first;
+            record.timestamp = stop.first.second;
+            record.owner = order.owner;
+            record.selfTradePrevention = order.selfTradePrevention;
+            appendRecord(out, record, records);
+        }
+        return stops.size();
+    }
+
+    // Add the record to records and write records out when it is full
+    static void appendRecord(ofstream &out, const SnapshotOrder &record, vector<SnapshotOrder> &records)
+    {
+        records.push_back(record);
+        if (records.size() == records.capacity())
+        {
+            out.write((const char *)records.data(), records.size() * sizeof(SnapshotOrder));
+            records.clear();
+        }
+    }
+
+    // The last interned symbol, it points into the symbol table so it stays valid
+    string_view lastSymbol;
+    uint32_t lastSymbolId = UINT32_MAX;
+};
+
+//Input vector<string> of commands and the sink that receives the output
+//We loop through each command and find the matching functions with that commands. 
+//At the end the depth of every symbol is written to the sink
+void run(vector<string> const &input, EventSink &sink)
+{
+    MatchingEngine engine(sink);
+    for (const string &line : input)
+    {
+        engine.processLine(line);
+    }
+    engine.finish();
+}
+
+//Input vector<string> of commands 
+//Output: the CSV lines of the trades followed by the depth of every symbol
+vector<string> run(vector<string> const &input)
+{
+    //Final result vector
+    vector<string> finalResult;
+    TextWriter writer(finalResult);
+    run(input, writer);
+    return finalResult;
+}
+
+// TradeRecorder is the sink of a shard worker, it keeps the trades and the L2 updates with the timestamp of the command that made them
+// so the dispatcher can merge the trades of all shards back into the order of the input.
+class TradeRecorder : public EventSink
+{
+public:
+    int timestamp = 0;
+    vector<pair<int, MatchedOrders>> trades;
+    vector<pair<int, BookLevel>> levels;
+
+    void onSymbol(uint32_t, const string &) override {}
+    void onTrade(const MatchedOrders &matchedOrders) override
+    {
+        trades.emplace_back(timestamp, matchedOrders);
+    }
+    void onBookHeader(uint32_t) override {}
+    void onDepthRow(uint32_t, const Limit *, const Limit *) override {}
+    void onLevelChange(const BookLevel &level) override
+    {
+        levels.emplace_back(timestamp, level);
+    }
+};
+
+// ShardWorker owns the books of a disjoint set of symbols and matches their commands on its own thread.
+// The books are indexed by the global symbol id, the books of the symbols of other shards stay empty.
+// Commands arrive in batches through submit(), waitIdle() returns once every submitted command is processed.
+class ShardWorker
+{
+public:
+    OrderIndex orderLookUp;
+    vector<LimitBook> books;
+    TradeRecorder recorder;
+    // The orders that left the books of the shard since the last drain (filled, cancelled, pulled, or an INSERT that
+    // never rested), so the dispatcher can forget their routes. An id may be listed when it is back in the book.
+    vector<int> departed;
+    // The AMEND and PULL commands for an order the shard does not have, the ShardedEngine reports them
+    RejectCounts rejects;
+
+    ShardWorker(bool levelUpdates)
+    {
+        this->levelUpdates = levelUpdates;
+        orderLookUp.erasedLog = &departed;
+        stopping = false;
+        submitted = 0;
+        processed = 0;
+        worker = thread([this]() { loop(); });
+    }
+
+    ~ShardWorker()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wakeUp.notify_one();
+        worker.join();
+    }
+
+    void submit(vector<Command> &batch)
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            pending.insert(pending.end(), batch.begin(), batch.end());
+            submitted += batch.size();
+        }
+        batch.clear();
+        wakeUp.notify_one();
+    }
+
+    void waitIdle()
+    {
+        unique_lock<mutex> guard(lock);
+        idle.wait(guard, [this]() { return processed == submitted; });
+    }
+
+private:
+    thread worker;
+    mutex lock;
+    condition_variable wakeUp;
+    condition_variable idle;
+    vector<Command> pending;
+    bool stopping;
+    size_t submitted;
+    size_t processed;
+    bool levelUpdates;
+
+    void loop()
+    {
+        vector<Command> batch;
+        while (true)
+        {
+            {
+                unique_lock<mutex> guard(lock);
+                wakeUp.wait(guard, [this]() { return !pending.empty() || stopping; });
+                if (pending.empty())
+                {
+                    return;
+                }
+                batch.swap(pending);
+            }
+            for (const Command &command : batch)
+            {
+                process(command);
+            }
+            {
+                lock_guard<mutex> guard(lock);
+                processed += batch.size();
+            }
+            batch.clear();
+            idle.notify_all();
+        }
+    }
+
+    void process(const Command &command)
+    {
+        recorder.timestamp = command.timestamp;
+        if (command.type == INSERT_COMMAND)
+        {
+            while (books.size() <= command.symbolId)
+            {
+                books.emplace_back();
+                books.back().symbolId = (uint32_t)(books.size() - 1);
+                books.back().trackLevels = levelUpdates;
+            }
+        }
+        processCommand(command, recorder, orderLookUp, books, rejects);
+        if (command.type == INSERT_COMMAND && orderLookUp.find(command.orderId) == nullptr)
+        {
+            departed.push_back(command.orderId);
+        }
+    }
+};
+
+// ShardedEngine matches the symbols on several threads. The books of different symbols are independent, so every symbol
+// is owned by one ShardWorker (symbol id modulo the number of shards), and the calling thread only parses and dispatches:
+// - an INSERT goes to the shard of its symbol, the symbol is interned here so the ids are the same as in MatchingEngine
+// - an AMEND or PULL goes to the shard of the symbol of the order (orderRoutes remembers it from the INSERT),
+//   an unknown order goes to shard 0 which reports it
+// Each shard gets its commands in input order, so the result of every symbol is the same as on one thread.
+// Every DRAIN_INTERVAL commands (and on flush) the dispatcher waits for the shards and merges their trades by timestamp,
+// so the output is identical to the output of MatchingEngine, and the memory used for the trades stays bounded.
+// orderRoutes keeps an entry for every order that may still rest: at every drain the routes of the orders the shards
+// report in departed are dropped, so it stays about as large as the books.
+class ShardedEngine : public LineProcessor
+{
+public:
+    static const size_t BATCH_SIZE = 256;
+    static const size_t DRAIN_INTERVAL = 1 << 16;
+
+    ShardedEngine(int shardCount, EventSink &sink, bool levelUpdates = false) : sink(sink)
+    {
+        for (int i = 0; i < shardCount; i++)
+        {
+            workers.emplace_back(new ShardWorker(levelUpdates));
+        }
+        batches.resize(shardCount);
+        timestamp = 0;
+        sinceDrain = 0;
+    }
+
+    void processLine(string_view line) override
+    {
+        Command command;
+        if (!parseCommand(line, command))
+        {
+            timestamp++;
+            return;
+        }
+        command.timestamp = timestamp++;
+        uint32_t shard = 0;
+        if (command.type == INSERT_COMMAND)
+        {
+            size_t knownSymbols = symbols.size();
+            command.symbolId = symbols.intern(command.symbolView());
+            if (symbols.size() > knownSymbols)
+            {
+                symbolEvents.emplace_back(command.timestamp, command.symbolId);
+            }
+            orderRoutes.insert(command.orderId, OrderLocation{command.symbolId, 0});
+            shard = shardOf(command.symbolId);
+        }
+        else
+        {
+            OrderLocation *route = orderRoutes.find(command.orderId);
+            if (route != nullptr)
+            {
+                shard = shardOf(route->symbolId);
+            }
+            if (command.type == PULL_COMMAND && route != nullptr)
+            {
+                orderRoutes.erase(command.orderId);
+            }
+        }
+        batches[shard].push_back(command);
+        if (batches[shard].size() >= BATCH_SIZE)
+        {
+            workers[shard]->submit(batches[shard]);
+        }
+        if (++sinceDrain >= DRAIN_INTERVAL)
+        {
+            drain();
+        }
+    }
+
+    void flush() override
+    {
+        drain();
+        sink.flush();
+    }
+
+    // Print out the unmatched pairs group by symbol alphabetically, every book is read from the shard that owns it
+    void finish() override
+    {
+        drain();
+        RejectCounts rejects;
+        for (auto &worker : workers)
+        {
+            rejects.add(worker->rejects);
+        }
+        rejects.report();
+        for (uint32_t symbolId : symbols.sortedIds())
+        {
+            outPutSymbol(sink, workers[shardOf(symbolId)]->books[symbolId], symbolId);
+        }
+        sink.flush();
+    }
+
+private:
+    EventSink &sink;
+    SymbolTable symbols;
+    OrderIndex orderRoutes;
+    vector<unique_ptr<ShardWorker>> workers;
+    vector<vector<Command>> batches;
+    // New symbols since the last drain with the timestamp of the INSERT that introduced them
+    vector<pair<int, uint32_t>> symbolEvents;
+    int timestamp;
+    size_t sinceDrain;
+
+    uint32_t shardOf(uint32_t symbolId) const
+    {
+        return symbolId % workers.size();
+    }
+
+    // Wait until every shard processed its commands and write their trades to the sink in timestamp order.
+    // A new symbol is written before the trades of the INSERT that introduced it, like MatchingEngine does.
+    void drain()
+    {
+        for (size_t shard = 0; shard < workers.size(); shard++)
+        {
+            if (!batches[shard].empty())
+            {
+                workers[shard]->submit(batches[shard]);
+            }
+        }
+        for (auto &worker : workers)
+        {
+            worker->waitIdle();
+        }
+        // The shards are idle, their indexes can be read here. A reported order that is back in its book keeps its route.
+        for (auto &worker : workers)
+        {
+            for (int orderId : worker->departed)
+            {
+                OrderLocation *route = orderRoutes.find(orderId);
+                if (route != nullptr && workers[shardOf(route->symbolId)]->orderLookUp.find(orderId) == nullptr)
+                {
+                    orderRoutes.erase(orderId);
+                }
+            }
+            worker->departed.clear();
         }
-    } 
-    //Print out the unmatched pairs before and individals group by symbol alphabetically 
-    outPutPerSymbol(finalResult, bookLookUp, allSymbols);
-    return finalResult;
+        // The events of one command are ordered like MatchingEngine writes them: the new symbol, the trades,
+        // then the L2 updates. The merge key is the timestamp times 3 plus that rank.
+        vector<size_t> nextTrade(workers.size(), 0);
+        vector<size_t> nextLevel(workers.size(), 0);
+        size_t nextSymbol = 0;
+        while (true)
+        {
+            int64_t bestKey = INT64_MAX;
+            int bestShard = -1;
+            bool bestIsLevel = false;
+            for (size_t shard = 0; shard < workers.size(); shard++)
+            {
+                TradeRecorder &recorder = workers[shard]->recorder;
+                if (nextTrade[shard] < recorder.trades.size() && 3 * (int64_t)recorder.trades[nextTrade[shard]].first + 1 < bestKey)
+                {
+                    bestKey = 3 * (int64_t)recorder.trades[nextTrade[shard]].first + 1;
+                    bestShard = (int)shard;
+                    bestIsLevel = false;
+                }
+                if (nextLevel[shard] < recorder.levels.size() && 3 * (int64_t)recorder.levels[nextLevel[shard]].first + 2 < bestKey)
+                {
+                    bestKey = 3 * (int64_t)recorder.levels[nextLevel[shard]].first + 2;
+                    bestShard = (int)shard;
+                    bestIsLevel = true;
+                }
+            }
+            if (nextSymbol < symbolEvents.size() && 3 * (int64_t)symbolEvents[nextSymbol].first < bestKey)
+            {
+                uint32_t symbolId = symbolEvents[nextSymbol++].second;
+                sink.onSymbol(symbolId, symbols.name(symbolId));
+                continue;
+            }
+            if (bestShard < 0)
+            {
+                break;
+            }
+            TradeRecorder &recorder = workers[bestShard]->recorder;
+            if (bestIsLevel)
+            {
+                sink.onLevelChange(recorder.levels[nextLevel[bestShard]++].second);
+            }
+            else
+            {
+                sink.onTrade(recorder.trades[nextTrade[bestShard]++].second);
+            }
+        }
+        for (auto &worker : workers)
+        {
+            worker->recorder.trades.clear();
+            worker->recorder.levels.clear();
+        }
+        symbolEvents.clear();
+        sinceDrain = 0;
+    }
+};
+
+// What a pipeline stage passes to the next one besides the data itself
+enum PipelineControl : uint8_t {DATA_ITEM, FLUSH_ITEM, FINISH_ITEM, STOP_ITEM};
+
+// PipelineCommand is a parsed line on its way from the parser to the matcher
+struct PipelineCommand
+{
+    PipelineControl control;
+    Command command;
+};
+
+// PipelineEvent is one EventSink call on its way from the matcher to the writer.
+// The symbol name and the levels are pointers into the matcher's state: the names never move,
+// and the depth is only written at the end, when the books do not change anymore.
+enum PipelineEventType : uint8_t {SYMBOL_EVENT, TRADE_EVENT, BOOK_HEADER_EVENT, DEPTH_EVENT, LEVEL_EVENT};
+
+struct PipelineEvent
+{
+    PipelineControl control;
+    PipelineEventType type;
+    uint32_t symbolId;
+    const string *symbol;
+    const Limit *bid;
+    const Limit *ask;
+    MatchedOrders trade;
+    BookLevel level;
+};
+
+// RingSink is the sink of the matcher stage, it forwards every call to the writer stage through the ring
+template<typename Ring>
+class RingSink : public EventSink
+{
+public:
+    RingSink(Ring &ring) : ring(ring) {}
+
+    void onSymbol(uint32_t symbolId, const string &symbol) override
+    {
+        PipelineEvent event = makeEvent(SYMBOL_EVENT, symbolId);
+        event.symbol = &symbol;
+        ring.push(event);
+    }
+    void onTrade(const MatchedOrders &matchedOrders) override
+    {
+        PipelineEvent event = makeEvent(TRADE_EVENT, matchedOrders.symbolId);
+        event.trade = matchedOrders;
+        ring.push(event);
+    }
+    void onBookHeader(uint32_t symbolId) override
+    {
+        ring.push(makeEvent(BOOK_HEADER_EVENT, symbolId));
+    }
+    void onDepthRow(uint32_t symbolId, const Limit *bid, const Limit *ask) override
+    {
+        PipelineEvent event = makeEvent(DEPTH_EVENT, symbolId);
+        event.bid = bid;
+        event.ask = ask;
+        ring.push(event);
+    }
+    void onLevelChange(const BookLevel &level) override
+    {
+        PipelineEvent event = makeEvent(LEVEL_EVENT, level.symbolId);
+        event.level = level;
+        ring.push(event);
+    }
+    void flush() override
+    {
+        PipelineEvent event;
+        event.control = FLUSH_ITEM;
+        ring.push(event);
+    }
+
+private:
+    Ring &ring;
+
+    static PipelineEvent makeEvent(PipelineEventType type, uint32_t symbolId)
+    {
+        PipelineEvent event;
+        event.control = DATA_ITEM;
+        event.type = type;
+        event.symbolId = symbolId;
+        return event;
+    }
+};
+
+// PipelineEngine runs the engine as three stages connected by SpscRings:
+// - parser: the calling thread, it parses every line and pushes the command
+// - matcher: a thread that owns a MatchingEngine and pushes its sink calls
+// - writer: a thread that replays the sink calls on the real sink, so formatting and write() overlap with matching
+// The stages keep the order of their input, so the output is the same as the output of MatchingEngine.
+// flush() travels through both rings, so a flush reaches the sink after everything that was read before it.
+class PipelineEngine : public LineProcessor
+{
+public:
+    static const size_t COMMAND_RING_SIZE = 1 << 12;
+    static const size_t EVENT_RING_SIZE = 1 << 12;
+    typedef SpscRing<PipelineCommand, COMMAND_RING_SIZE> CommandRing;
+    typedef SpscRing<PipelineEvent, EVENT_RING_SIZE> EventRing;
+
+    PipelineEngine(EventSink &sink, bool reportStats, bool levelUpdates = false)
+        : sink(sink), commands(new CommandRing()), events(new EventRing())
+    {
+        this->reportStats = reportStats;
+        this->levelUpdates = levelUpdates;
+        writer = thread([this]() { writeLoop(); });
+        matcher = thread([this]() { matchLoop(); });
+    }
+
+    ~PipelineEngine()
+    {
+        if (matcher.joinable())
+        {
+            stop(STOP_ITEM);
+        }
+    }
+
+    void processLine(string_view line) override
+    {
+        PipelineCommand item;
+        item.control = DATA_ITEM;
+        if (!parseCommand(line, item.command))
+        {
+            item.command.type = INVALID_COMMAND;
+        }
+        commands->push(item);
+    }
+
+    void flush() override
+    {
+        PipelineCommand item;
+        item.control = FLUSH_ITEM;
+        commands->push(item);
+    }
+
+    // Let the matcher write the depth, wait for the writer to drain and report the back-pressure if asked
+    void finish() override
+    {
+        stop(FINISH_ITEM);
+        if (reportStats)
+        {
+            cerr << "pipeline commands " << commands->pushed()
+                 << " parser stalls " << commands->fullStalls
+                 << " matcher idle " << commands->emptyStalls
+                 << " events " << events->pushed()
+                 << " matcher stalls " << events->fullStalls
+                 << " writer idle " << events->emptyStalls << endl;
+        }
+    }
+
+private:
+    EventSink &sink;
+    unique_ptr<CommandRing> commands;
+    unique_ptr<EventRing> events;
+    thread matcher;
+    thread writer;
+    bool reportStats;
+    bool levelUpdates;
+
+    void stop(PipelineControl control)
+    {
+        PipelineCommand item;
+        item.control = control;
+        commands->push(item);
+        // The matcher joins the writer before it exits
+        matcher.join();
+    }
+
+    void matchLoop()
+    {
+        RingSink<EventRing> ringSink(*events);
+        MatchingEngine engine(ringSink, levelUpdates);
+        while (true)
+        {
+            PipelineCommand item = commands->pop();
+            if (item.control == DATA_ITEM)
+            {
+                engine.process(item.command);
+            }
+            else if (item.control == FLUSH_ITEM)
+            {
+                ringSink.flush();
+            }
+            else
+            {
+                if (item.control == FINISH_ITEM)
+                {
+                    engine.finish();
+                }
+                PipelineEvent event;
+                event.control = STOP_ITEM;
+                events->push(event);
+                // The writer may still read the names and the levels of the engine
+                writer.join();
+                return;
+            }
+        }
+    }
+
+    void writeLoop()
+    {
+        while (true)
+        {
+            PipelineEvent event = events->pop();
+            if (event.control == STOP_ITEM)
+            {
+                return;
+            }
+            if (event.control == FLUSH_ITEM)
+            {
+                sink.flush();
+                continue;
+            }
+            switch (event.type)
+            {
+            case SYMBOL_EVENT:
+                sink.onSymbol(event.symbolId, *event.symbol);
+                break;
+            case TRADE_EVENT:
+                sink.onTrade(event.trade);
+                break;
+            case BOOK_HEADER_EVENT:
+                sink.onBookHeader(event.symbolId);
+                break;
+            case DEPTH_EVENT:
+                sink.onDepthRow(event.symbolId, event.bid, event.ask);
+                break;
+            case LEVEL_EVENT:
+                sink.onLevelChange(event.level);
+                break;
+            }
+        }
+    }
+};
+
+// LineReader reads a file descriptor in chunks into one fixed buffer and cuts the chunks into lines
+// (any whitespace separates two lines, like cin >> does). Memory stays bounded by the buffer, and
+// the lines that already arrived are handed out without waiting for the end of the input.
+class LineReader
+{
+public:
+    static const size_t BUFFER_SIZE = 1 << 16;
+
+    LineReader(int fd)
+    {
+        this->fd = fd;
+        this->buffer.resize(BUFFER_SIZE);
+        this->used = 0;
+        this->atEnd = false;
+    }
+
+    // Read the next chunk and call onLine for every complete line in it. The views are only valid during the call.
+    // Output: false once the input is exhausted (the last line without a newline is handed out then)
+    template <class F>
+    bool readChunk(F onLine)
+    {
+        if (atEnd)
+        {
+            return false;
+        }
+        if (used == buffer.size())
+        {
+            // A single line fills the whole buffer, hand it out as it is
+            onLine(string_view(buffer.data(), used));
+            used = 0;
+        }
+#ifdef _WIN32
+        long bytes = _read(fd, buffer.data() + used, (unsigned)(buffer.size() - used));
+#else
+        long bytes = ::read(fd, buffer.data() + used, buffer.size() - used);
+        while (bytes < 0 && errno == EINTR)
+        {
+            bytes = ::read(fd, buffer.data() + used, buffer.size() - used);
+        }
+#endif
+        if (bytes <= 0)
+        {
+            atEnd = true;
+            splitLines(used, onLine);
+            used = 0;
+            return false;
+        }
+        used += bytes;
+        size_t consumed = 0;
+        for (size_t i = used; i > 0; i--)
+        {
+            if (isSeparator(buffer[i - 1]))
+            {
+                consumed = i;
+                break;
+            }
+        }
+        splitLines(consumed, onLine);
+        // Keep the incomplete line at the front of the buffer
+        memmove(buffer.data(), buffer.data() + consumed, used - consumed);
+        used -= consumed;
+        return true;
+    }
+
+private:
+    int fd;
+    vector<char> buffer;
+    size_t used;
+    bool atEnd;
+
+    static bool isSeparator(char c)
+    {
+        return c == '\n' || c == ' ' || c == '\t' || c == '\r';
+    }
+
+    template <class F>
+    void splitLines(size_t length, F &onLine)
+    {
+        size_t start = 0;
+        for (size_t i = 0; i <= length; i++)
+        {
+            if (i == length || isSeparator(buffer[i]))
+            {
+                if (i > start)
+                {
+                    onLine(string_view(buffer.data() + start, i - start));
+                }
+                start = i + 1;
+            }
+        }
+    }
+};
+
+// Returns true if the token is the line count at the start of the input (only digits)
+bool isLineCount(string_view line)
+{
+    return all_of(line.begin(), line.end(), [](char c) { return (unsigned)(c - '0') < 10; });
+}
+
+// Streaming mode: the commands are processed as they are read from fd and the trades are written through the sink
+// after every chunk of input, instead of reading every line into a vector first and printing at the end.
+// The first line is the number of commands, like in the batch input, it is skipped.
+void runStream(int fd, LineProcessor &engine)
+{
+    LineReader reader(fd);
+    bool firstLine = true;
+    auto onLine = [&](string_view line)
+    {
+        if (firstLine)
+        {
+            firstLine = false;
+            if (isLineCount(line))
+            {
+                return;
+            }
+        }
+        engine.processLine(line);
+    };
+    while (reader.readChunk(onLine))
+    {
+        engine.flush();
+    }
+    engine.finish();
+}
+
+#ifndef _WIN32
+// Replay mode for a whole command file: the file is mapped into memory and every command is parsed straight from the mapped bytes,
+// no line is copied into a string. The extra memory does not depend on the size of the file:
+// - madvise(MADV_SEQUENTIAL) lets the kernel read ahead and drop the pages behind the parser
+// - every REPLAY_RELEASE_BYTES, the pages that were parsed already are released with MADV_DONTNEED
+// - with prefetch, a helper thread touches the pages up to REPLAY_PREFETCH_BYTES ahead of the parser,
+//   so the page faults happen on the helper thread and not on the matching thread
+// Output: false if the file can not be mapped
+bool runReplay(const char *path, LineProcessor &engine, bool prefetch)
+{
+    const size_t REPLAY_RELEASE_BYTES = 64 << 20;
+    const size_t REPLAY_PREFETCH_BYTES = 32 << 20;
+    const size_t REPLAY_PROGRESS_BYTES = 1 << 20;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)fileStat.st_size;
+    if (size == 0)
+    {
+        close(fd);
+        engine.finish();
+        return true;
+    }
+    char *data = (char *)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    // progress is how far the parser is, the helper thread stays at most REPLAY_PREFETCH_BYTES ahead of it
+    atomic<size_t> progress(0);
+    atomic<bool> done(false);
+    thread prefetcher;
+    if (prefetch)
+    {
+        prefetcher = thread([&]()
+        {
+            const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+            volatile char touched = 0;
+            size_t ahead = 0;
+            while (ahead < size && !done.load(memory_order_relaxed))
+            {
+                if (ahead > progress.load(memory_order_relaxed) + REPLAY_PREFETCH_BYTES)
+                {
+                    this_thread::sleep_for(chrono::microseconds(50));
+                    continue;
+                }
+                touched = data[ahead];
+                ahead += pageSize;
+            }
+            (void)touched;
+        });
+    }
+
+    const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t released = 0;
+    size_t reported = 0;
+    size_t start = 0;
+    bool firstLine = true;
+    for (size_t i = 0; i <= size; i++)
+    {
+        if (i == size || data[i] == '\n' || data[i] == ' ' || data[i] == '\t' || data[i] == '\r')
+        {
+            if (i > start)
+            {
+                string_view line(data + start, i - start);
+                if (!firstLine || !isLineCount(line))
+                {
+                    engine.processLine(line);
+                }
+                firstLine = false;
+            }
+            start = i + 1;
+            if (start - reported >= REPLAY_PROGRESS_BYTES)
+            {
+                progress.store(start, memory_order_relaxed);
+                reported = start;
+            }
+            if (start - released >= REPLAY_RELEASE_BYTES)
+            {
+                // Release the pages that were parsed, keep the page that holds the current position
+                size_t end = start / pageSize * pageSize;
+                madvise(data + released, end - released, MADV_DONTNEED);
+                released = end;
+            }
+        }
+    }
+    done.store(true);
+    if (prefetcher.joinable())
+    {
+        prefetcher.join();
+    }
+    munmap(data, size);
+    engine.finish();
+    return true;
 }
+#endif
 
-int main()
+//Run with:
+//  --binary          write the output as fixed-width binary records (see BinaryWriter) instead of CSV lines
+//  --stream [file]   process the commands as they arrive from stdin (or from the file) and write the trades while reading,
+//                    instead of reading the whole input first
+//  --replay file     replay a whole command file through a memory mapping (see runReplay)
+//  --prefetch        with --replay, fault the pages in from a helper thread
+//  --shards N        match the symbols on N threads (see ShardedEngine)
+//  --pipeline        parse, match and write on three threads (see PipelineEngine)
+//  --l2              write an L2 update for every price level changed by a command
+//  --stats           with --pipeline, print the back-pressure of the rings to stderr at the end
+//  --snapshot PATH   write a snapshot of the books to PATH at the end of the input and on SIGUSR2
+//  --snapshot-every N  also write it after every N input lines
+//  --restore PATH    start from the snapshot at PATH and skip the input lines it already includes
+//  --journal PATH    append every command to the journal at PATH, with group commit. A journal that is not empty
+//                    is only appended to with --recover, the new commands have to continue its timestamps
+//  --group-commit N  sync the journal every N commands [64]
+//  --group-commit-us T  or when the oldest unsynced command is T microseconds old [200]
+//  --recover PATH    replay the journal at PATH first (after --restore) without writing its trades again,
+//                    and skip the input lines it includes. Trades the crashed run had not written out are lost
+//                    (the output is at most once, see ReplaySink)
+// The snapshot and journal options need the single threaded engine.
+// Built with -DENGINE_METRICS, the latency histograms and counters go to stderr at exit and on SIGUSR1.
+#ifndef ENGINE_NO_MAIN
+int main(int argc, char *argv[])
 {
+    bool binaryOutput = false;
+    bool streaming = false;
+    bool replay = false;
+    bool prefetch = false;
+    int shards = 1;
+    bool pipeline = false;
+    bool stats = false;
+    bool levelUpdates = false;
+    const char *snapshotPath = nullptr;
+    int snapshotEvery = 0;
+    const char *restorePath = nullptr;
+    const char *journalPath = nullptr;
+    const char *recoverPath = nullptr;
+    int groupCommit = 64;
+    int groupCommitMicros = 200;
+    const char *inputPath = nullptr;
+#ifdef ENGINE_METRICS
+    // The registry of the metrics is created before the exit handler, so it is destroyed after the handler ran
+    EngineMetrics::local();
+    atexit([]() { EngineMetrics::dumpAll(cerr); });
+#ifdef SIGUSR1
+    signal(SIGUSR1, [](int) { metricsDumpRequested = 1; });
+#endif
+#endif
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--binary")
+        {
+            binaryOutput = true;
+        }
+        else if (arg == "--stream")
+        {
+            streaming = true;
+        }
+        else if (arg == "--replay")
+        {
+            replay = true;
+        }
+        else if (arg == "--prefetch")
+        {
+            prefetch = true;
+        }
+        else if (arg == "--pipeline")
+        {
+            pipeline = true;
+        }
+        else if (arg == "--l2")
+        {
+            levelUpdates = true;
+        }
+        else if (arg == "--stats")
+        {
+            stats = true;
+        }
+        else if (arg == "--shards" && i + 1 < argc)
+        {
+            shards = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--snapshot" && i + 1 < argc)
+        {
+            snapshotPath = argv[++i];
+        }
+        else if (arg == "--snapshot-every" && i + 1 < argc)
+        {
+            snapshotEvery = max(0, atoi(argv[++i]));
+        }
+        else if (arg == "--restore" && i + 1 < argc)
+        {
+            restorePath = argv[++i];
+        }
+        else if (arg == "--journal" && i + 1 < argc)
+        {
+            journalPath = argv[++i];
+        }
+        else if (arg == "--recover" && i + 1 < argc)
+        {
+            recoverPath = argv[++i];
+        }
+        else if (arg == "--group-commit" && i + 1 < argc)
+        {
+            groupCommit = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--group-commit-us" && i + 1 < argc)
+        {
+            groupCommitMicros = max(1, atoi(argv[++i]));
+        }
+        else
+        {
+            inputPath = argv[i];
+            streaming = true;
+        }
+    }
+
+    unique_ptr<EventSink> writer;
+    if (binaryOutput)
+    {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        writer.reset(new BinaryWriter(cout));
+    }
+    else
+    {
+        writer.reset(new TextWriter(cout));
+    }
+    // The journal is declared after the writer and before the engine: it is closed (and synced) after the engine is gone
+    Journal journal;
+    unique_ptr<LineProcessor> engine;
+    bool durable = snapshotPath != nullptr || restorePath != nullptr || journalPath != nullptr || recoverPath != nullptr;
+    if (durable && (pipeline || shards > 1))
+    {
+        cerr << "Snapshots and the journal need the single threaded engine" << endl;
+        return 1;
+    }
+    if (durable)
+    {
+        MatchingEngine *matchingEngine = new MatchingEngine(*writer, levelUpdates);
+        engine.reset(matchingEngine);
+        if (restorePath != nullptr && !matchingEngine->loadSnapshot(restorePath))
+        {
+            cerr << "Can not restore " << restorePath << endl;
+            return 1;
+        }
+        if (recoverPath != nullptr && !matchingEngine->recoverJournal(recoverPath))
+        {
+            cerr << "Can not recover " << recoverPath << endl;
+            return 1;
+        }
+        if (journalPath != nullptr)
+        {
+            // Without --recover the timestamps start again at the snapshot (or 0), a recovery would skip the new records
+            struct stat info;
+            if (recoverPath == nullptr && stat(journalPath, &info) == 0 && info.st_size > 0)
+            {
+                cerr << "The journal " << journalPath << " is not empty, recover it with --recover" << endl;
+                return 1;
+            }
+            if (!journal.open(journalPath, groupCommit, groupCommitMicros))
+            {
+                cerr << "Can not open " << journalPath << endl;
+                return 1;
+            }
+            matchingEngine->journal = &journal;
+        }
+        if (snapshotPath != nullptr)
+        {
+            matchingEngine->snapshotPath = snapshotPath;
+            matchingEngine->snapshotEvery = snapshotEvery;
+#ifdef SIGUSR2
+            signal(SIGUSR2, [](int) { snapshotRequested = 1; });
+#endif
+        }
+    }
+    else if (pipeline)
+    {
+        engine.reset(new PipelineEngine(*writer, stats, levelUpdates));
+    }
+    else if (shards > 1)
+    {
+        engine.reset(new ShardedEngine(shards, *writer, levelUpdates));
+    }
+    else
+    {
+        engine.reset(new MatchingEngine(*writer, levelUpdates));
+    }
+
+    if (replay && inputPath != nullptr)
+    {
+#ifndef _WIN32
+        if (!runReplay(inputPath, *engine, prefetch))
+        {
+            cerr << "Can not map " << inputPath << endl;
+            return 1;
+        }
+        return journal.close() ? 0 : 1;
+#endif
+        // No mmap on Windows, the file is streamed instead
+    }
+
+    if (streaming)
+    {
+        int fd = 0;
+        if (inputPath != nullptr)
+        {
+            fd = open(inputPath, O_RDONLY);
+            if (fd < 0)
+            {
+                cerr << "Can not open " << inputPath << endl;
+                return 1;
+            }
+        }
+        runStream(fd, *engine);
+        return journal.close() ? 0 : 1;
+    }
+
     int line = 0;
     cin >> line;
-    vector<string> command;
     for (int i = 0; i < line; i++)
     {
         string tmp;
         cin >> tmp;
-        command.push_back(tmp);
-    }
-    vector<string> tmp1 = run(command);
-    for (string line : tmp1)
-    {
-        cout << line << endl;
+        engine->processLine(tmp);
     }
-    return 0;
-}
\ No newline at end of file
+    engine->finish();
+    return journal.close() ? 0 : 1;
+}
+#endif